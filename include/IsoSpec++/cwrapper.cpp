@@ -28,6 +28,62 @@
 
 using namespace IsoSpec;  // NOLINT(build/namespaces) - all of this really should be in a namespace IsoSpec, but C doesn't have them...
 
+namespace
+{
+
+// Write the masses and probabilities of up to max_confs subsequent configurations.
+template<typename GenType> size_t fill_masses_probs(GenType* generator, double* masses, double* probs, size_t max_confs)
+{
+    size_t written = 0;
+
+    if(max_confs > 0)
+        generator->for_each_conf([&](const GenType& gen)
+        {
+            masses[written] = gen.mass();
+            probs[written] = gen.prob();
+            written++;
+            return written < max_confs;
+        });
+
+    return written;
+}
+
+// Same as above, for the generators which can be advanced one run of marginal 0 at a time.
+template<typename GenType> size_t fill_masses_probs_runs(GenType* generator, double* masses, double* probs, size_t max_confs)
+{
+    size_t written = 0;
+
+    while(written < max_confs && generator->advanceToNextRun(max_confs - written))
+    {
+        const double base_mass = generator->run_base_mass();
+        const double base_prob = generator->run_base_prob();
+        const double* run_masses = generator->run_masses();
+        const double* run_probs = generator->run_probs();
+        const unsigned int run_end = generator->run_end();
+
+        for(unsigned int ii = generator->run_begin(); ii < run_end; ii++)
+        {
+            masses[written] = base_mass + run_masses[ii];
+            probs[written] = base_prob * run_probs[ii];
+            written++;
+        }
+    }
+
+    return written;
+}
+
+size_t fill_masses_probs(IsoThresholdGenerator* generator, double* masses, double* probs, size_t max_confs)
+{
+    return fill_masses_probs_runs(generator, masses, probs, max_confs);
+}
+
+size_t fill_masses_probs(IsoLayeredGenerator* generator, double* masses, double* probs, size_t max_confs)
+{
+    return fill_masses_probs_runs(generator, masses, probs, max_confs);
+}
+
+}  // namespace
+
 
 extern "C"
 {
@@ -116,6 +172,10 @@ void get_conf_signature##generatorType(void* generator, int* space)\
 
 #define ISOSPEC_C_FN_DELETE(generatorType) void delete##generatorType(void* generator){ delete reinterpret_cast<generatorType*>(generator); }
 
+#define ISOSPEC_C_FN_CODE_FILL_MASSES_PROBS(generatorType)\
+size_t fillMassesProbs##generatorType(void* generator, double* masses, double* probs, size_t max_confs)\
+{ return fill_masses_probs(reinterpret_cast<generatorType*>(generator), masses, probs, max_confs); }
+
 #define ISOSPEC_C_FN_CODES(generatorType)\
 ISOSPEC_C_FN_CODE(generatorType, double, mass) \
 ISOSPEC_C_FN_CODE(generatorType, double, lprob) \
@@ -145,6 +205,7 @@ void* setupIsoThresholdGenerator(void* iso,
     return reinterpret_cast<void*>(iso_tmp);
 }
 ISOSPEC_C_FN_CODES(IsoThresholdGenerator)
+ISOSPEC_C_FN_CODE_FILL_MASSES_PROBS(IsoThresholdGenerator)
 
 
 // ______________________________________________________LAYERED GENERATOR
@@ -166,6 +227,7 @@ void* setupIsoLayeredGenerator(void* iso,
     return reinterpret_cast<void*>(iso_tmp);
 }
 ISOSPEC_C_FN_CODES(IsoLayeredGenerator)
+ISOSPEC_C_FN_CODE_FILL_MASSES_PROBS(IsoLayeredGenerator)
 
 
 // ______________________________________________________ORDERED GENERATOR
@@ -181,6 +243,7 @@ void* setupIsoOrderedGenerator(void* iso,
     return reinterpret_cast<void*>(iso_tmp);
 }
 ISOSPEC_C_FN_CODES(IsoOrderedGenerator)
+ISOSPEC_C_FN_CODE_FILL_MASSES_PROBS(IsoOrderedGenerator)
 
 // ______________________________________________________STOCHASTIC GENERATOR
 void* setupIsoStochasticGenerator(void* iso,
@@ -197,6 +260,7 @@ void* setupIsoStochasticGenerator(void* iso,
     return reinterpret_cast<void*>(iso_tmp);
 }
 ISOSPEC_C_FN_CODES(IsoStochasticGenerator)
+ISOSPEC_C_FN_CODE_FILL_MASSES_PROBS(IsoStochasticGenerator)
 
 // ______________________________________________________ FixedEnvelopes
 
@@ -244,6 +308,44 @@ void* setupStochasticFixedEnvelope(void* iso,
     return reinterpret_cast<void*>(ret);
 }
 
+void* setupSeededStochasticFixedEnvelope(void* iso,
+                    size_t no_molecules,
+                    uint64_t seed,
+                    double precision,
+                    double beta_bias,
+                    bool get_confs,
+                    unsigned int n_threads)
+{
+    FixedEnvelope* ret = new FixedEnvelope(  // Use copy elision to allocate on heap with named constructor
+            FixedEnvelope::FromStochasticSeeded(Iso(*reinterpret_cast<const Iso*>(iso), true),
+                                                no_molecules,
+                                                seed,
+                                                precision,
+                                                beta_bias,
+                                                get_confs,
+                                                n_threads));
+
+    return reinterpret_cast<void*>(ret);
+}
+
+void* setupWindowFixedEnvelope(void* iso,
+                    double mmin,
+                    double mmax,
+                    double threshold,
+                    bool absolute,
+                    bool get_confs)
+{
+    FixedEnvelope* ret = new FixedEnvelope(  // Use copy elision to allocate on heap with named constructor
+            FixedEnvelope::FromWindow(Iso(*reinterpret_cast<const Iso*>(iso), true),
+                                      mmin,
+                                      mmax,
+                                      threshold,
+                                      absolute,
+                                      get_confs));
+
+    return reinterpret_cast<void*>(ret);
+}
+
 
 void* setupBinnedFixedEnvelope(void* iso,
                     double target_total_prob,
@@ -347,12 +449,15 @@ double abyssalWassersteinDistance(void* tabulator1, void* tabulator2, double aby
     return reinterpret_cast<FixedEnvelope*>(tabulator1)->AbyssalWassersteinDistance(*reinterpret_cast<FixedEnvelope*>(tabulator2), abyss_depth, other_scale);
 }
 
-#if 0
+double scaledAbyssalWassersteinDistance(void* tabulator1, void* const* tabulators, double abyss_depth, const double* other_scales, size_t N)
+{
+    return reinterpret_cast<FixedEnvelope*>(tabulator1)->ScaledAbyssalWassersteinDistance(reinterpret_cast<FixedEnvelope* const*>(tabulators), abyss_depth, other_scales, N);
+}
+
 double abyssalWassersteinDistanceGrad(void* const* envelopes, const double* scales, double* ret_gradient, size_t N, double abyss_depth_exp, double abyss_depth_the)
 {
     return AbyssalWassersteinDistanceGrad(reinterpret_cast<FixedEnvelope* const*>(envelopes), scales, ret_gradient, N, abyss_depth_exp, abyss_depth_the);
 }
-#endif
 
 struct ws_match_res wassersteinMatch(void* tabulator1, void* tabulator2, double flow_dist, double other_scale)
 {
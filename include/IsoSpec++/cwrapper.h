@@ -22,6 +22,7 @@
 #define ISOSPEC_ALGO_THRESHOLD_RELATIVE 3
 #define ISOSPEC_ALGO_LAYERED_ESTIMATE 4
 
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -64,6 +65,12 @@ ISOSPEC_C_FN_HEADER_GET_CONF_SIGNATURE(generatorType) \
 ISOSPEC_C_FN_HEADER(generatorType, bool, advanceToNextConfiguration) \
 ISOSPEC_C_FN_HEADER(generatorType, void, delete)
 
+/* Write the masses and probabilities of up to max_confs subsequent configurations into the given arrays and return
+   how many were written: fewer than max_confs means the generator is exhausted. Much faster than calling
+   advanceToNextConfiguration, mass and prob for each configuration. */
+#define ISOSPEC_C_FN_HEADER_FILL_MASSES_PROBS(generatorType)\
+ISOSPEC_C_API size_t fillMassesProbs##generatorType(void* generator, double* masses, double* probs, size_t max_confs);
+
 
 
 
@@ -75,6 +82,7 @@ ISOSPEC_C_API void* setupIsoThresholdGenerator(void* iso,
                                  int _hashSize,
                                  bool reorder_marginals);
 ISOSPEC_C_FN_HEADERS(IsoThresholdGenerator)
+ISOSPEC_C_FN_HEADER_FILL_MASSES_PROBS(IsoThresholdGenerator)
 
 
 // ______________________________________________________LAYERED GENERATOR
@@ -84,18 +92,21 @@ ISOSPEC_C_API void* setupIsoLayeredGenerator(void* iso,
                                bool reorder_marginals,
                                double t_prob_hint);
 ISOSPEC_C_FN_HEADERS(IsoLayeredGenerator)
+ISOSPEC_C_FN_HEADER_FILL_MASSES_PROBS(IsoLayeredGenerator)
 
 // ______________________________________________________ORDERED GENERATOR
 ISOSPEC_C_API void* setupIsoOrderedGenerator(void* iso,
                                int _tabSize,
                                int _hashSize);
 ISOSPEC_C_FN_HEADERS(IsoOrderedGenerator)
+ISOSPEC_C_FN_HEADER_FILL_MASSES_PROBS(IsoOrderedGenerator)
 
 ISOSPEC_C_API void* setupIsoStochasticGenerator(void* iso,
                                    size_t no_molecules,
                                    double precision,
                                    double beta_bias);
 ISOSPEC_C_FN_HEADERS(IsoStochasticGenerator)
+ISOSPEC_C_FN_HEADER_FILL_MASSES_PROBS(IsoStochasticGenerator)
 
 
 ISOSPEC_C_API void* setupThresholdFixedEnvelope(void* iso,
@@ -114,6 +125,21 @@ ISOSPEC_C_API void* setupStochasticFixedEnvelope(void* iso,
                               double beta_bias,
                               bool get_confs);
 
+ISOSPEC_C_API void* setupSeededStochasticFixedEnvelope(void* iso,
+                              size_t no_molecules,
+                              uint64_t seed,
+                              double precision,
+                              double beta_bias,
+                              bool get_confs,
+                              unsigned int n_threads);
+
+ISOSPEC_C_API void* setupWindowFixedEnvelope(void* iso,
+                              double mmin,
+                              double mmax,
+                              double threshold,
+                              bool absolute,
+                              bool get_confs);
+
 ISOSPEC_C_API void* setupBinnedFixedEnvelope(void* iso,
                     double target_total_prob,
                     double bin_width,
@@ -141,7 +167,8 @@ ISOSPEC_C_API double empiricStddev(void* tabulator);
 ISOSPEC_C_API double wassersteinDistance(void* tabulator1, void* tabulator2);
 ISOSPEC_C_API double orientedWassersteinDistance(void* tabulator1, void* tabulator2);
 ISOSPEC_C_API double abyssalWassersteinDistance(void* tabulator1, void* tabulator2, double abyss_depth, double other_scale);
-//ISOSPEC_C_API double abyssalWassersteinDistanceGrad(void* const* envelopes, const double* scales, double* ret_gradient, size_t N, double abyss_depth_exp, double abyss_depth_the);
+ISOSPEC_C_API double scaledAbyssalWassersteinDistance(void* tabulator1, void* const* tabulators, double abyss_depth, const double* other_scales, size_t N);
+ISOSPEC_C_API double abyssalWassersteinDistanceGrad(void* const* envelopes, const double* scales, double* ret_gradient, size_t N, double abyss_depth_exp, double abyss_depth_the);
 
 ISOSPEC_C_API struct ws_match_res{
 double res1;
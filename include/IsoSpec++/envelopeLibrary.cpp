@@ -0,0 +1,322 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#include "envelopeLibrary.h"
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include "misc.h"
+
+#if ISOSPEC_GOT_SYSTEM_MMAN
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace IsoSpec
+{
+
+namespace {
+
+// The payloads are aligned to this many bytes within the file
+const uint64_t library_alignment = 64;
+
+const char library_magic[8] = {'I', 'S', 'O', 'E', 'N', 'V', 'L', 'B'};
+const uint32_t library_byte_order = 0x01020304;
+
+struct LibraryHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t no_envelopes;
+    uint64_t records_offset;
+};
+
+struct LibraryRecord
+{
+    uint64_t confs_no;
+    uint64_t masses_offset;
+    uint64_t probs_offset;
+    uint64_t confs_offset;  /*!< Zero if the configurations weren't stored. */
+    double total_prob;
+    int32_t allDim;
+    uint32_t reserved;
+};
+
+inline uint64_t align_up(uint64_t offset)
+{
+    return (offset + library_alignment - 1) / library_alignment * library_alignment;
+}
+
+}  // namespace
+
+FixedEnvelopeView::FixedEnvelopeView(const double* masses, const double* probs, const int* confs, size_t confs_no, int allDim, double total_prob)
+{
+    // The tables are never written to through the view: only the read-only methods of FixedEnvelope are exposed
+    _masses = const_cast<double*>(masses);
+    _probs = const_cast<double*>(probs);
+    _confs = const_cast<int*>(confs);
+    _confs_no = confs_no;
+    this->allDim = allDim;
+    allDimSizeofInt = allDim * sizeof(int);
+    sorted_by_mass = true;
+    sorted_by_prob = false;
+    this->total_prob = total_prob;
+}
+
+FixedEnvelopeView::FixedEnvelopeView(const FixedEnvelopeView& other) :
+FixedEnvelopeView(other._masses, other._probs, other._confs, other._confs_no, other.allDim, other.total_prob)
+{}
+
+EnvelopeLibrary::EnvelopeLibrary(const char* path) : data(nullptr), data_size(0), no_envelopes(0)
+{
+#if ISOSPEC_GOT_SYSTEM_MMAN
+    const int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error(std::string("Could not open the envelope library ") + path);
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        close(fd);
+        throw std::runtime_error(std::string("Could not read the envelope library ") + path);
+    }
+    data_size = st.st_size;
+
+    void* mapping = mmap(nullptr, data_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // The mapping stays valid
+    if(mapping == MAP_FAILED)
+        throw std::runtime_error(std::string("Could not map the envelope library ") + path);
+    data = reinterpret_cast<const char*>(mapping);
+#else
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if(!file)
+        throw std::runtime_error(std::string("Could not open the envelope library ") + path);
+    data_size = file.tellg();
+    char* buffer = reinterpret_cast<char*>(malloc(data_size));
+    if(buffer == nullptr)
+        throw std::bad_alloc();
+    file.seekg(0);
+    if(!file.read(buffer, data_size))
+    {
+        free(buffer);
+        throw std::runtime_error(std::string("Could not read the envelope library ") + path);
+    }
+    data = buffer;
+#endif
+
+    LibraryHeader header;
+    if(data_size < sizeof(header))
+    {
+        release();
+        throw std::invalid_argument("Not an envelope library: the file is truncated");
+    }
+    memcpy(&header, data, sizeof(header));
+
+    const char* error = nullptr;
+    if(memcmp(header.magic, library_magic, sizeof(library_magic)) != 0)
+        error = "Not an envelope library";
+    else if(header.byte_order != library_byte_order)
+        error = "The envelope library was written on a machine with a different byte order";
+    else if(header.version != ISOSPEC_ENVELOPE_LIBRARY_VERSION)
+        error = "Unsupported envelope library version";
+    else if(header.records_offset % alignof(LibraryRecord) != 0 || header.records_offset > data_size ||
+            header.no_envelopes > (data_size - header.records_offset) / sizeof(LibraryRecord))
+        error = "Malformed envelope library: the table of envelopes is out of bounds";
+
+    if(error != nullptr)
+    {
+        release();
+        throw std::invalid_argument(error);
+    }
+
+    no_envelopes = header.no_envelopes;
+}
+
+EnvelopeLibrary::~EnvelopeLibrary()
+{
+    release();
+}
+
+void EnvelopeLibrary::release()
+{
+#if ISOSPEC_GOT_SYSTEM_MMAN
+    if(data != nullptr)
+        munmap(const_cast<char*>(data), data_size);
+#else
+    free(const_cast<char*>(data));
+#endif
+    data = nullptr;
+}
+
+FixedEnvelopeView EnvelopeLibrary::operator[](size_t idx) const
+{
+    if(idx >= no_envelopes)
+        throw std::out_of_range("Envelope library index out of range");
+
+    LibraryHeader header;
+    memcpy(&header, data, sizeof(header));
+    const LibraryRecord& record = reinterpret_cast<const LibraryRecord*>(data + header.records_offset)[idx];
+
+    auto in_bounds = [this, &record](uint64_t offset, size_t entry_size, size_t alignment)
+    {
+        return offset % alignment == 0 && offset <= data_size && record.confs_no <= (data_size - offset) / entry_size;
+    };
+
+    const size_t conf_size = static_cast<size_t>(record.allDim) * sizeof(int);
+    if(!in_bounds(record.masses_offset, sizeof(double), alignof(double)) ||
+       !in_bounds(record.probs_offset, sizeof(double), alignof(double)) ||
+       record.allDim < 0 ||
+       (record.confs_offset != 0 && (conf_size == 0 || !in_bounds(record.confs_offset, conf_size, alignof(int)))))
+        throw std::invalid_argument("Malformed envelope library: envelope " + std::to_string(idx) + " is out of bounds");
+
+    return FixedEnvelopeView(
+        reinterpret_cast<const double*>(data + record.masses_offset),
+        reinterpret_cast<const double*>(data + record.probs_offset),
+        record.confs_offset != 0 ? reinterpret_cast<const int*>(data + record.confs_offset) : nullptr,
+        record.confs_no,
+        record.allDim,
+        record.total_prob);
+}
+
+void EnvelopeLibrary::all_views(std::vector<FixedEnvelopeView>& views, std::vector<const FixedEnvelope*>& envelopes) const
+{
+    views.clear();
+    views.reserve(no_envelopes);
+    envelopes.resize(no_envelopes);
+    for(size_t ii = 0; ii < no_envelopes; ii++)
+    {
+        views.push_back((*this)[ii]);
+        envelopes[ii] = &views.back();
+    }
+}
+
+void EnvelopeLibrary::WassersteinDistances(const FixedEnvelope& query, double* ret, size_t best_k, unsigned int n_threads) const
+{
+    std::vector<FixedEnvelopeView> views;
+    std::vector<const FixedEnvelope*> candidates;
+    all_views(views, candidates);
+
+    query.WassersteinDistances(candidates.data(), no_envelopes, ret, best_k, n_threads);
+}
+
+void EnvelopeLibrary::AbyssalWassersteinDistances(const FixedEnvelope& query, double* ret, double abyss_depth, double other_scale,
+                                                  size_t best_k, unsigned int n_threads) const
+{
+    std::vector<FixedEnvelopeView> views;
+    std::vector<const FixedEnvelope*> candidates;
+    all_views(views, candidates);
+
+    query.AbyssalWassersteinDistances(candidates.data(), no_envelopes, ret, abyss_depth, other_scale, best_k, n_threads);
+}
+
+// Write the rows of width entries of table, in the given order, to the file
+template<typename T> static void write_ordered(std::ofstream& file, const T* table, const std::vector<size_t>& order, size_t width)
+{
+    const size_t chunk = 65536;
+    std::unique_ptr<T[]> buffer(new T[chunk * width]);
+
+    for(size_t start = 0; start < order.size(); start += chunk)
+    {
+        const size_t end = (std::min)(order.size(), start + chunk);
+        for(size_t ii = start; ii < end; ii++)
+            memcpy(buffer.get() + (ii - start) * width, table + order[ii] * width, width * sizeof(T));
+        file.write(reinterpret_cast<const char*>(buffer.get()), (end - start) * width * sizeof(T));
+    }
+}
+
+static void pad_to(std::ofstream& file, uint64_t offset)
+{
+    static const char zeros[library_alignment] = {};
+    const uint64_t pos = static_cast<uint64_t>(file.tellp());
+    file.write(zeros, offset - pos);
+}
+
+void EnvelopeLibrary::write(const char* path, const FixedEnvelope* const * envelopes, size_t no_envelopes)
+{
+    LibraryHeader header;
+    memcpy(header.magic, library_magic, sizeof(library_magic));
+    header.version = ISOSPEC_ENVELOPE_LIBRARY_VERSION;
+    header.byte_order = library_byte_order;
+    header.no_envelopes = no_envelopes;
+    header.records_offset = align_up(sizeof(header));
+
+    std::vector<LibraryRecord> records(no_envelopes);
+    uint64_t offset = align_up(header.records_offset + no_envelopes * sizeof(LibraryRecord));
+
+    for(size_t ii = 0; ii < no_envelopes; ii++)
+    {
+        const FixedEnvelope& envelope = *envelopes[ii];
+        LibraryRecord& record = records[ii];
+        record.confs_no = envelope.confs_no();
+        record.allDim = envelope.confs() != nullptr ? envelope.getAllDim() : 0;
+        record.reserved = 0;
+
+        record.total_prob = 0.0;
+        for(size_t jj = 0; jj < envelope.confs_no(); jj++)
+            record.total_prob += envelope.prob(jj);
+
+        record.masses_offset = offset;
+        offset = align_up(offset + record.confs_no * sizeof(double));
+        record.probs_offset = offset;
+        offset = align_up(offset + record.confs_no * sizeof(double));
+        if(envelope.confs() != nullptr && record.confs_no > 0 && record.allDim > 0)
+        {
+            record.confs_offset = offset;
+            offset = align_up(offset + record.confs_no * record.allDim * sizeof(int));
+        }
+        else
+            record.confs_offset = 0;
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if(!file)
+        throw std::runtime_error(std::string("Could not create the envelope library ") + path);
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    pad_to(file, header.records_offset);
+    file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(LibraryRecord));
+
+    for(size_t ii = 0; ii < no_envelopes; ii++)
+    {
+        const FixedEnvelope& envelope = *envelopes[ii];
+        const LibraryRecord& record = records[ii];
+        const std::vector<size_t> order = envelope.get_mass_order();
+
+        pad_to(file, record.masses_offset);
+        write_ordered(file, envelope.masses(), order, 1);
+        pad_to(file, record.probs_offset);
+        write_ordered(file, envelope.probs(), order, 1);
+        if(record.confs_offset != 0)
+        {
+            pad_to(file, record.confs_offset);
+            write_ordered(file, envelope.confs(), order, record.allDim);
+        }
+    }
+
+    if(!file.flush())
+        throw std::runtime_error(std::string("Could not write the envelope library ") + path);
+}
+
+void EnvelopeLibrary::write(const char* path, const std::vector<const FixedEnvelope*>& envelopes)
+{
+    write(path, envelopes.data(), envelopes.size());
+}
+
+}  // namespace IsoSpec
@@ -0,0 +1,118 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "platform.h"
+#include "fixedEnvelopes.h"
+
+// The version of the envelope library file format written by EnvelopeLibrary::write, and the only one it reads
+#define ISOSPEC_ENVELOPE_LIBRARY_VERSION 1
+
+namespace IsoSpec
+{
+
+class EnvelopeLibrary;
+
+//! A read-only FixedEnvelope whose tables belong to someone else, typically an EnvelopeLibrary.
+/*!
+    Only the non-modifying methods of FixedEnvelope are available. The peaks are always sorted by mass, so
+    the Wasserstein distances and bin() work without touching the tables. The owner of the tables must outlive the view.
+*/
+class ISOSPEC_EXPORT_SYMBOL FixedEnvelopeView : private FixedEnvelope
+{
+    friend class EnvelopeLibrary;
+
+    FixedEnvelopeView(const double* masses, const double* probs, const int* confs, size_t confs_no, int allDim, double total_prob);
+
+ public:
+    FixedEnvelopeView(const FixedEnvelopeView& other);
+    FixedEnvelopeView& operator=(const FixedEnvelopeView& other) = delete;
+
+    ~FixedEnvelopeView() { release_everything(); }
+
+    using FixedEnvelope::confs_no;
+    using FixedEnvelope::getAllDim;
+    using FixedEnvelope::masses;
+    using FixedEnvelope::probs;
+    using FixedEnvelope::confs;
+    using FixedEnvelope::mass;
+    using FixedEnvelope::prob;
+    using FixedEnvelope::conf;
+    using FixedEnvelope::get_total_prob;
+    using FixedEnvelope::empiric_average_mass;
+    using FixedEnvelope::empiric_variance;
+    using FixedEnvelope::empiric_stddev;
+    using FixedEnvelope::WassersteinDistance;
+    using FixedEnvelope::OrientedWassersteinDistance;
+    using FixedEnvelope::bin;
+    using FixedEnvelope::WassersteinDistances;
+    using FixedEnvelope::AbyssalWassersteinDistances;
+
+    inline double WassersteinDistance(FixedEnvelopeView& other) { return FixedEnvelope::WassersteinDistance(other); }
+    inline double OrientedWassersteinDistance(FixedEnvelopeView& other) { return FixedEnvelope::OrientedWassersteinDistance(other); }
+
+    //! Make an ordinary FixedEnvelope out of the view, copying the tables.
+    inline FixedEnvelope copy() const { return FixedEnvelope(*this); }
+};
+
+//! A collection of precomputed envelopes stored in a file, accessed without loading or copying it.
+/*!
+    The file consists of a header, a table with the sizes and offsets of the envelopes, and the masses, probabilities
+    and (optionally) configurations of each envelope as plain arrays. The file is mmap'ed read-only, so opening it
+    takes constant time, and the pages are only read in as the envelopes are used - and shared between all the processes
+    using the same library. On platforms without mmap, the file is read into memory instead.
+
+    The format follows the byte order and type sizes of the machine that wrote it: a library is meant to be used where
+    it's been written, and opening it on an incompatible machine throws std::invalid_argument.
+*/
+class ISOSPEC_EXPORT_SYMBOL EnvelopeLibrary
+{
+    const char* data;
+    size_t data_size;
+    size_t no_envelopes;
+
+    void release();
+    void all_views(std::vector<FixedEnvelopeView>& views, std::vector<const FixedEnvelope*>& envelopes) const;
+
+ public:
+    //! Open the library file at path, throwing std::runtime_error if it can't be read and std::invalid_argument if it's not a valid library.
+    explicit EnvelopeLibrary(const char* path);
+
+    EnvelopeLibrary(const EnvelopeLibrary& other) = delete;
+    EnvelopeLibrary& operator=(const EnvelopeLibrary& other) = delete;
+
+    ~EnvelopeLibrary();
+
+    inline size_t size() const { return no_envelopes; }
+
+    //! Get the idx-th envelope. Its entry is validated here, rather than all of them on opening the library.
+    FixedEnvelopeView operator[](size_t idx) const;
+
+    //! Compute the distances from query to all the envelopes of the library, see FixedEnvelope::WassersteinDistances().
+    void WassersteinDistances(const FixedEnvelope& query, double* ret, size_t best_k = 0, unsigned int n_threads = 1) const;
+    void AbyssalWassersteinDistances(const FixedEnvelope& query, double* ret, double abyss_depth, double other_scale = 1.0,
+                                     size_t best_k = 0, unsigned int n_threads = 1) const;
+
+    //! Write a library file with the given envelopes, in that order. The envelopes are stored sorted by mass.
+    static void write(const char* path, const FixedEnvelope* const * envelopes, size_t no_envelopes);
+    static void write(const char* path, const std::vector<const FixedEnvelope*>& envelopes);
+};
+
+}  // namespace IsoSpec
@@ -16,7 +16,12 @@
 
 #include "fixedEnvelopes.h"
 #include <limits>
+#include <memory>
+#include <queue>
+#include <random>
+#include <unordered_map>
 #include "isoMath.h"
+#include "parallel.h"
 
 namespace IsoSpec
 {
@@ -108,84 +113,284 @@ FixedEnvelope FixedEnvelope::operator*(const FixedEnvelope& other) const
     return FixedEnvelope(nmasses, nprobs, tgt_idx);
 }
 
-void FixedEnvelope::sort_by_mass()
+// Copy the peaks of an envelope, sorted by descending probability if they aren't already
+static void copy_by_prob(const double* probs, const double* masses, size_t n, bool sorted,
+                         std::unique_ptr<double[]>& sprobs, std::unique_ptr<double[]>& smasses)
+{
+    sprobs.reset(new double[n]);
+    smasses.reset(new double[n]);
+    memcpy(sprobs.get(), probs, n * sizeof(double));
+    memcpy(smasses.get(), masses, n * sizeof(double));
+    if(!sorted)
+        sort_descending_together(sprobs.get(), smasses.get(), n);
+}
+
+namespace {
+
+// The peaks summed up into mass bins, laid out as FixedEnvelope::bin() does. The bins are kept in pages of
+// ISOSPEC_BIN_PAGE_SIZE, allocated when first hit, so the memory used is proportional to the populated parts of the mass
+// range rather than to its length. The pages are found through a flat table over the whole range or, for ranges too
+// wide even for that, a hash map.
+class MassBins
+{
+    typedef std::unique_ptr<double[]> Page;
+
+    const double bin_width;
+    const double middle;
+    const double hwmm;
+    const int64_t first_bin;
+    std::vector<Page> flat_pages;
+    std::unordered_map<int64_t, Page> sparse_pages;
+    bool flat;
+
+    // The peaks come in clusters, so most of them hit the same page as the previous one
+    int64_t last_page_idx;
+    double* last_page;
+
+    inline int64_t bin_of(double mass) const { return static_cast<int64_t>(floor((mass + hwmm) / bin_width)); }
+
+    double* page(int64_t page_idx)
+    {
+        Page& page = flat ? flat_pages[page_idx] : sparse_pages[page_idx];
+        if(!page)
+            page.reset(new double[ISOSPEC_BIN_PAGE_SIZE]());
+        last_page_idx = page_idx;
+        last_page = page.get();
+        return last_page;
+    }
+
+    template<typename F> static void for_each_bin_in_page(const double* page, int64_t first, double bin_width, double middle, F&& f)
+    {
+        for(int64_t ii = 0; ii < ISOSPEC_BIN_PAGE_SIZE; ii++)
+            if(page[ii] > 0.0)
+                f((first + ii) * bin_width + middle, page[ii]);
+    }
+
+ public:
+    MassBins(double _bin_width, double _middle, double min_mass, double max_mass) :
+    bin_width(_bin_width), middle(_middle), hwmm(0.5 * _bin_width - _middle), first_bin(bin_of(min_mass)),
+    last_page_idx(-1), last_page(nullptr)
+    {
+        const double no_pages = (floor((max_mass + hwmm) / bin_width) - floor((min_mass + hwmm) / bin_width)) / ISOSPEC_BIN_PAGE_SIZE + 1.0;
+        flat = no_pages <= ISOSPEC_MAX_DENSE_BIN_PAGES;
+        if(flat)
+            flat_pages.resize(static_cast<size_t>(no_pages));
+    }
+
+    ISOSPEC_FORCE_INLINE void add(double mass, double prob)
+    {
+        const int64_t bin = bin_of(mass) - first_bin;
+        const int64_t page_idx = bin / ISOSPEC_BIN_PAGE_SIZE;
+        double* target = page_idx == last_page_idx ? last_page : page(page_idx);
+        target[bin % ISOSPEC_BIN_PAGE_SIZE] += prob;
+    }
+
+    //! Call f(bin_middle, bin_prob) on the nonempty bins, in the order of increasing mass.
+    template<typename F> void for_each_bin(F&& f) const
+    {
+        if(flat)
+        {
+            for(size_t ii = 0; ii < flat_pages.size(); ii++)
+                if(flat_pages[ii])
+                    for_each_bin_in_page(flat_pages[ii].get(), first_bin + static_cast<int64_t>(ii) * ISOSPEC_BIN_PAGE_SIZE, bin_width, middle, f);
+            return;
+        }
+
+        std::vector<int64_t> page_idxs;
+        page_idxs.reserve(sparse_pages.size());
+        for(const auto& page : sparse_pages)
+            page_idxs.push_back(page.first);
+        std::sort(page_idxs.begin(), page_idxs.end());
+        for(int64_t page_idx : page_idxs)
+            for_each_bin_in_page(sparse_pages.at(page_idx).get(), first_bin + page_idx * ISOSPEC_BIN_PAGE_SIZE, bin_width, middle, f);
+    }
+};
+
+}  // namespace
+
+template<typename Walk> FixedEnvelope FixedEnvelope::collect_peaks(Walk&& walk, double bin_width, double bin_middle, double min_mass, double max_mass)
+{
+    FixedEnvelope ret;
+    ret.reallocate_memory<false>(ISOSPEC_INIT_TABLE_SIZE);
+    ret.total_prob = NAN;
+
+    if(bin_width > 0.0)
+    {
+        MassBins bins(bin_width, bin_middle, min_mass, max_mass);
+        walk([&bins](double mass, double prob) { bins.add(mass, prob); });
+        bins.for_each_bin([&ret](double mass, double prob) { ret.store_conf(mass, prob); });
+        ret.sorted_by_mass = true;
+    }
+    else
+        walk([&ret](double mass, double prob) { ret.store_conf(mass, prob); });
+
+    return ret;
+}
+
+FixedEnvelope FixedEnvelope::convolve(const FixedEnvelope& other, double threshold, bool absolute, double bin_width, double bin_middle) const
+{
+    if(_confs_no == 0 || other._confs_no == 0)
+        return FixedEnvelope();
+
+    std::unique_ptr<double[]> probs1, masses1, probs2, masses2;
+    copy_by_prob(_probs, _masses, _confs_no, sorted_by_prob, probs1, masses1);
+    copy_by_prob(other._probs, other._masses, other._confs_no, other.sorted_by_prob, probs2, masses2);
+
+    const double cutoff = absolute ? threshold : threshold * probs1[0] * probs2[0];
+    const size_t n1 = _confs_no;
+    const size_t n2 = other._confs_no;
+
+    auto walk = [&](auto&& emit)
+    {
+        for(size_t ii = 0; ii < n1 && probs1[ii] * probs2[0] >= cutoff; ii++)
+            for(size_t jj = 0; jj < n2; jj++)
+            {
+                const double prob = probs1[ii] * probs2[jj];
+                if(prob < cutoff)
+                    break;
+                emit(masses1[ii] + masses2[jj], prob);
+            }
+    };
+
+    const std::pair<const double*, const double*> range1 = std::minmax_element(masses1.get(), masses1.get() + n1);
+    const std::pair<const double*, const double*> range2 = std::minmax_element(masses2.get(), masses2.get() + n2);
+
+    return collect_peaks(walk, bin_width, bin_middle, *range1.first + *range2.first, *range1.second + *range2.second);
+}
+
+FixedEnvelope FixedEnvelope::convolve_total_prob(const FixedEnvelope& other, double target_total_prob, double bin_width, double bin_middle) const
+{
+    if(_confs_no == 0 || other._confs_no == 0 || target_total_prob <= 0.0)
+        return FixedEnvelope();
+
+    std::unique_ptr<double[]> probs1, masses1, probs2, masses2;
+    copy_by_prob(_probs, _masses, _confs_no, sorted_by_prob, probs1, masses1);
+    copy_by_prob(other._probs, other._masses, other._confs_no, other.sorted_by_prob, probs2, masses2);
+
+    const size_t n1 = _confs_no;
+    const size_t n2 = other._confs_no;
+
+    double total1 = 0.0;
+    for(size_t ii = 0; ii < n1; ii++)
+        total1 += probs1[ii];
+    double total2 = 0.0;
+    for(size_t ii = 0; ii < n2; ii++)
+        total2 += probs2[ii];
+    const double target = (std::min)(target_total_prob, 1.0) * total1 * total2;
+
+    typedef std::pair<double, std::pair<size_t, size_t> > Product;
+
+    auto walk = [&](auto&& emit)
+    {
+        // The frontier of the products not generated yet: (ii, jj+1) goes in once (ii, jj) is out, and (ii+1, 0)
+        // once (ii, 0) is. So each product enters it after all the more probable ones with the same ii or jj.
+        std::priority_queue<Product> frontier;
+        frontier.push(Product(probs1[0] * probs2[0], std::make_pair(0, 0)));
+        double acc_prob = 0.0;
+
+        while(!frontier.empty() && acc_prob < target)
+        {
+            const double prob = frontier.top().first;
+            const size_t ii = frontier.top().second.first;
+            const size_t jj = frontier.top().second.second;
+            frontier.pop();
+
+            emit(masses1[ii] + masses2[jj], prob);
+            acc_prob += prob;
+
+            if(jj + 1 < n2)
+                frontier.push(Product(probs1[ii] * probs2[jj+1], std::make_pair(ii, jj+1)));
+            if(jj == 0 && ii + 1 < n1)
+                frontier.push(Product(probs1[ii+1] * probs2[0], std::make_pair(ii+1, 0)));
+        }
+    };
+
+    const std::pair<const double*, const double*> range1 = std::minmax_element(masses1.get(), masses1.get() + n1);
+    const std::pair<const double*, const double*> range2 = std::minmax_element(masses2.get(), masses2.get() + n2);
+
+    FixedEnvelope ret = collect_peaks(walk, bin_width, bin_middle, *range1.first + *range2.first, *range1.second + *range2.second);
+    if(bin_width <= 0.0)
+        ret.sorted_by_prob = true;
+    return ret;
+}
+
+void FixedEnvelope::sort_by_mass(unsigned int n_threads)
 {
     if(sorted_by_mass)
         return;
 
-    sort_by(_masses);
+    sort_by(_masses, n_threads);
 
     sorted_by_mass = true;
     sorted_by_prob = false;
 }
 
 
-void FixedEnvelope::sort_by_prob()
+void FixedEnvelope::sort_by_prob(unsigned int n_threads)
 {
     if(sorted_by_prob)
         return;
 
-    sort_by(_probs);
+    sort_by(_probs, n_threads);
 
     sorted_by_prob = true;
     sorted_by_mass = false;
 }
 
-template<typename T> void reorder_array(T* arr, size_t* order, size_t size, bool can_destroy = false)
+std::vector<size_t> FixedEnvelope::get_mass_order(unsigned int n_threads) const
 {
-    if(!can_destroy)
-    {
-        size_t* order_c = new size_t[size];
-        memcpy(order_c, order, sizeof(size_t)*size);
-        order = order_c;
-    }
-
-    for(size_t ii = 0; ii < size; ii++)
-        while(order[ii] != ii)
-        {
-            std::swap(arr[ii], arr[order[ii]]);
-            std::swap(order[order[ii]], order[ii]);
-        }
+    std::vector<size_t> ret(_confs_no);
+    radix_order_ascending(_masses, ret.data(), _confs_no, n_threads);
+    return ret;
+}
 
-    if(!can_destroy)
-        delete[] order;
+std::vector<size_t> FixedEnvelope::get_prob_order(unsigned int n_threads) const
+{
+    std::vector<size_t> ret(_confs_no);
+    radix_order_ascending(_probs, ret.data(), _confs_no, n_threads);
+    return ret;
 }
 
-void FixedEnvelope::sort_by(double* order)
+// Gather the entries (rows of width entries) of src into a new table, in the given order
+template<typename T> static T* gather_rows(const T* src, const size_t* order, size_t size, size_t width, unsigned int n_threads)
 {
-    size_t* indices = new size_t[_confs_no];
+    T* ret = reinterpret_cast<T*>(malloc(size * width * sizeof(T)));
+    if(ret == nullptr)
+        throw std::bad_alloc();
 
-    if(_confs_no <= 1)
-        return;
+    const size_t block = 65536;
+    parallel_for((size + block - 1) / block, n_threads, [&](size_t block_idx, unsigned int)
+    {
+        const size_t end = (std::min)(size, (block_idx + 1) * block);
+        for(size_t ii = block_idx * block; ii < end; ii++)
+            memcpy(ret + ii * width, src + order[ii] * width, width * sizeof(T));
+    });
 
-    for(size_t ii = 0; ii < _confs_no; ii++)
-        indices[ii] = ii;
+    return ret;
+}
 
-    std::sort<size_t*>(indices, indices + _confs_no, TableOrder<double>(order));
+void FixedEnvelope::sort_by(double* keys, unsigned int n_threads)
+{
+    if(_confs_no <= 1)
+        return;
 
-    size_t* inverse = new size_t[_confs_no];
+    std::unique_ptr<size_t[]> order(new size_t[_confs_no]);
+    radix_order_ascending(keys, order.get(), _confs_no, n_threads);
 
-    for(size_t ii = 0; ii < _confs_no; ii++)
-        inverse[indices[ii]] = ii;
+    double* new_masses = gather_rows(_masses, order.get(), _confs_no, 1, n_threads);
+    free(_masses);
+    _masses = new_masses;
 
-    delete[] indices;
+    double* new_probs = gather_rows(_probs, order.get(), _confs_no, 1, n_threads);
+    free(_probs);
+    _probs = new_probs;
 
-    reorder_array(_masses, inverse, _confs_no);
-    reorder_array(_probs,  inverse, _confs_no, _confs == nullptr);
     if(_confs != nullptr)
     {
-        int* swapspace = new int[allDim];
-        for(size_t ii = 0; ii < _confs_no; ii++)
-            while(inverse[ii] != ii)
-            {
-                memcpy(swapspace, &_confs[ii*allDim], allDimSizeofInt);
-                memcpy(&_confs[ii*allDim], &_confs[inverse[ii]*allDim], allDimSizeofInt);
-                memcpy(&_confs[inverse[ii]*allDim], swapspace, allDimSizeofInt);
-                std::swap(inverse[inverse[ii]], inverse[ii]);
-            }
-        delete[] swapspace;
+        int* new_confs = gather_rows(_confs, order.get(), _confs_no, allDim, n_threads);
+        free(_confs);
+        _confs = new_confs;
     }
-    delete[] inverse;
 }
 
 
@@ -263,16 +468,125 @@ void FixedEnvelope::resample(size_t samples, double beta_bias)
     memset(_probs + pidx, 0, sizeof(double)*(_confs_no - pidx));
 }
 
-FixedEnvelope FixedEnvelope::LinearCombination(const std::vector<const FixedEnvelope*>& spectra, const std::vector<double>& intensities)
+FixedEnvelope FixedEnvelope::LinearCombination(const std::vector<const FixedEnvelope*>& spectra, const std::vector<double>& intensities, double merge_epsilon, unsigned int n_threads)
 {
-    return LinearCombination(spectra.data(), intensities.data(), spectra.size());
+    return LinearCombination(spectra.data(), intensities.data(), spectra.size(), merge_epsilon, n_threads);
 }
 
-FixedEnvelope FixedEnvelope::LinearCombination(const FixedEnvelope* const * spectra, const double* intensities, size_t size)
+namespace {
+
+// A tournament tree of losers over k runs sorted by mass: the run with the lightest next peak (the earliest one on ties)
+// is found in log(k) comparisons after each peak taken from it, and with no data movement.
+class LoserTree
+{
+    const double* const* masses;
+    const size_t* ends;
+    size_t* positions;
+    const size_t k;
+    // tree[0] is the overall winner, tree[1..k) the losers of the matches in the internal nodes, the leaves are k..2k-1
+    std::vector<size_t> tree;
+
+    inline bool beats(size_t a, size_t b) const
+    {
+        if(positions[a] >= ends[a])
+            return false;
+        if(positions[b] >= ends[b])
+            return true;
+        const double ma = masses[a][positions[a]];
+        const double mb = masses[b][positions[b]];
+        return ma < mb || (ma == mb && a < b);
+    }
+
+ public:
+    LoserTree(const double* const* _masses, const size_t* _ends, size_t* _positions, size_t _k) :
+    masses(_masses), ends(_ends), positions(_positions), k(_k), tree(2*_k)
+    {
+        std::vector<size_t> winners(2*k);
+        for(size_t ii = 0; ii < k; ii++)
+            winners[k+ii] = ii;
+        for(size_t node = k-1; node > 0; node--)
+        {
+            const size_t a = winners[2*node];
+            const size_t b = winners[2*node+1];
+            const bool a_wins = beats(a, b);
+            winners[node] = a_wins ? a : b;
+            tree[node] = a_wins ? b : a;
+        }
+        tree[0] = winners[1];
+    }
+
+    //! The run with the next peak, or one past its end if all the runs are exhausted.
+    inline size_t winner() const { return tree[0]; }
+    inline bool exhausted() const { return positions[tree[0]] >= ends[tree[0]]; }
+
+    //! Take the next peak from the winning run and find the new winner.
+    inline void advance()
+    {
+        size_t winner = tree[0];
+        positions[winner]++;
+        for(size_t node = (k + winner) / 2; node > 0; node /= 2)
+            if(beats(tree[node], winner))
+                std::swap(tree[node], winner);
+        tree[0] = winner;
+    }
+};
+
+// Merge the spectra, restricted to [starts[ii], ends[ii]) each, into out_masses and out_probs.
+void merge_runs(const FixedEnvelope* const * spectra, const double* intensities, size_t size,
+                const size_t* starts, const size_t* ends, double* out_masses, double* out_probs)
+{
+    std::vector<const double*> masses(size);
+    std::vector<size_t> positions(starts, starts + size);
+    for(size_t ii = 0; ii < size; ii++)
+        masses[ii] = spectra[ii]->masses();
+
+    LoserTree tree(masses.data(), ends, positions.data(), size);
+
+    size_t cntr = 0;
+    while(!tree.exhausted())
+    {
+        const size_t run = tree.winner();
+        out_masses[cntr] = masses[run][positions[run]];
+        out_probs[cntr] = spectra[run]->prob(positions[run]) * intensities[run];
+        cntr++;
+        tree.advance();
+    }
+}
+
+// Collapse each group of consecutive peaks within merge_epsilon of the first one of the group into a single peak, at their
+// probability-weighted average mass, returning the new number of peaks. Exactly equal masses are kept exact.
+size_t merge_close_peaks(double* masses, double* probs, size_t size, double merge_epsilon)
+{
+    size_t out = 0;
+    size_t ii = 0;
+    while(ii < size)
+    {
+        const double start = masses[ii];
+        double prob = 0.0;
+        double weighted_offset = 0.0;
+        for(; ii < size && masses[ii] - start <= merge_epsilon; ii++)
+        {
+            prob += probs[ii];
+            weighted_offset += (masses[ii] - start) * probs[ii];
+        }
+        masses[out] = prob != 0.0 ? start + weighted_offset / prob : start;
+        probs[out] = prob;
+        out++;
+    }
+    return out;
+}
+
+}  // namespace
+
+FixedEnvelope FixedEnvelope::LinearCombination(const FixedEnvelope* const * spectra, const double* intensities, size_t size, double merge_epsilon, unsigned int n_threads)
 {
     size_t ret_size = 0;
+    bool all_sorted = true;
     for(size_t ii = 0; ii < size; ii++)
+    {
         ret_size += spectra[ii]->_confs_no;
+        all_sorted = all_sorted && (spectra[ii]->sorted_by_mass || spectra[ii]->_confs_no <= 1);
+    }
 
     double* newprobs  = reinterpret_cast<double*>(malloc(sizeof(double)*ret_size));
     if(newprobs == nullptr)
@@ -284,74 +598,134 @@ FixedEnvelope FixedEnvelope::LinearCombination(const FixedEnvelope* const * spec
         throw std::bad_alloc();
     }
 
-    size_t cntr = 0;
+    if(!all_sorted)
+    {
+        size_t cntr = 0;
+        for(size_t ii = 0; ii < size; ii++)
+        {
+            double mul = intensities[ii];
+            for(size_t jj = 0; jj < spectra[ii]->_confs_no; jj++)
+                newprobs[jj+cntr] = spectra[ii]->_probs[jj] * mul;
+            memcpy(newmasses + cntr, spectra[ii]->_masses, sizeof(double) * spectra[ii]->_confs_no);
+            cntr += spectra[ii]->_confs_no;
+        }
+        FixedEnvelope ret(newmasses, newprobs, cntr);
+        if(merge_epsilon >= 0.0)
+        {
+            ret.sort_by_mass(n_threads);
+            ret._confs_no = merge_close_peaks(ret._masses, ret._probs, ret._confs_no, merge_epsilon);
+        }
+        return ret;
+    }
+
+    n_threads = resolve_threads_no(n_threads);
+    const size_t n_segments = (n_threads > 1 && ret_size >= ISOSPEC_PARALLEL_MERGE_MIN_SIZE) ? 4 * static_cast<size_t>(n_threads) : 1;
+
+    std::vector<size_t> bounds((n_segments + 1) * size);
+
     for(size_t ii = 0; ii < size; ii++)
     {
-        double mul = intensities[ii];
-        for(size_t jj = 0; jj < spectra[ii]->_confs_no; jj++)
-            newprobs[jj+cntr] = spectra[ii]->_probs[jj] * mul;
-        memcpy(newmasses + cntr, spectra[ii]->_masses, sizeof(double) * spectra[ii]->_confs_no);
-        cntr += spectra[ii]->_confs_no;
+        bounds[ii] = 0;
+        bounds[n_segments * size + ii] = spectra[ii]->_confs_no;
     }
-    return FixedEnvelope(newmasses, newprobs, cntr);
-}
 
-double FixedEnvelope::WassersteinDistance(FixedEnvelope& other)
-{
-    double ret = 0.0;
-    if((get_total_prob()*0.999 > other.get_total_prob()) || (other.get_total_prob() > get_total_prob()*1.001))
-        throw std::logic_error("Spectra must be normalized before computing Wasserstein Distance");
+    if(n_segments > 1)
+    {
+        // Split the mass range at quantiles of a sample of all the peaks: the segments are then merged independently,
+        // each into its own part of the output, as the peaks of a segment come before all the peaks of the next one
+        const size_t stride = (std::max<size_t>)(1, ret_size / (n_segments * 64));
+        std::vector<double> samples;
+        for(size_t ii = 0; ii < size; ii++)
+            for(size_t jj = 0; jj < spectra[ii]->_confs_no; jj += stride)
+                samples.push_back(spectra[ii]->_masses[jj]);
+        std::sort(samples.begin(), samples.end());
+
+        for(size_t seg = 1; seg < n_segments; seg++)
+        {
+            const double splitter = samples[seg * samples.size() / n_segments];
+            for(size_t ii = 0; ii < size; ii++)
+                bounds[seg * size + ii] = std::lower_bound(spectra[ii]->_masses, spectra[ii]->_masses + spectra[ii]->_confs_no, splitter) - spectra[ii]->_masses;
+        }
+    }
 
-    if(_confs_no == 0 || other._confs_no == 0)
-        return 0.0;
+    std::vector<size_t> offsets(n_segments + 1, 0);
+    for(size_t seg = 0; seg < n_segments; seg++)
+    {
+        offsets[seg+1] = offsets[seg];
+        for(size_t ii = 0; ii < size; ii++)
+            offsets[seg+1] += bounds[(seg+1) * size + ii] - bounds[seg * size + ii];
+    }
 
-    sort_by_mass();
-    other.sort_by_mass();
+    parallel_for(size > 0 ? n_segments : 0, n_threads, [&](size_t seg, unsigned int)
+    {
+        merge_runs(spectra, intensities, size, &bounds[seg * size], &bounds[(seg+1) * size], newmasses + offsets[seg], newprobs + offsets[seg]);
+    });
 
+    if(merge_epsilon >= 0.0)
+        ret_size = merge_close_peaks(newmasses, newprobs, ret_size, merge_epsilon);
+
+    return FixedEnvelope(newmasses, newprobs, ret_size, true);
+}
+
+// The Wasserstein distance between two spectra sorted by mass. The merge picks the next peak without branching, and
+// the computation is abandoned (returning +inf) as soon as the distance accumulated so far exceeds bound.
+static double wasserstein_kernel(const double* masses1, const double* probs1, size_t n1,
+                                 const double* masses2, const double* probs2, size_t n2, double bound)
+{
+    double ret = 0.0;
     size_t idx_this = 0;
     size_t idx_other = 0;
 
     double acc_prob = 0.0;
     double last_point = 0.0;
 
-
-    while(idx_this < _confs_no && idx_other < other._confs_no)
+    while(idx_this < n1 && idx_other < n2)
     {
-        if(_masses[idx_this] < other._masses[idx_other])
-        {
-            ret += (_masses[idx_this] - last_point) * std::abs(acc_prob);
-            acc_prob += _probs[idx_this];
-            last_point = _masses[idx_this];
-            idx_this++;
-        }
-        else
-        {
-            ret += (other._masses[idx_other] - last_point) * std::abs(acc_prob);
-            acc_prob -= other._probs[idx_other];
-            last_point = other._masses[idx_other];
-            idx_other++;
-        }
+        const bool from_this = masses1[idx_this] < masses2[idx_other];
+        const double mass = from_this ? masses1[idx_this] : masses2[idx_other];
+        const double prob = from_this ? probs1[idx_this] : -probs2[idx_other];
+        ret += (mass - last_point) * std::abs(acc_prob);
+        acc_prob += prob;
+        last_point = mass;
+        idx_this += from_this;
+        idx_other += !from_this;
+        if(ISOSPEC_UNLIKELY(ret > bound))
+            return std::numeric_limits<double>::infinity();
     }
 
     acc_prob = std::abs(acc_prob);
 
-    while(idx_this < _confs_no)
+    while(idx_this < n1)
     {
-        ret += (_masses[idx_this] - last_point) * acc_prob;
-        acc_prob -= _probs[idx_this];
-        last_point = _masses[idx_this];
+        ret += (masses1[idx_this] - last_point) * acc_prob;
+        acc_prob -= probs1[idx_this];
+        last_point = masses1[idx_this];
         idx_this++;
     }
 
-    while(idx_other < other._confs_no)
+    while(idx_other < n2)
     {
-        ret += (other._masses[idx_other] - last_point) * acc_prob;
-        acc_prob -= other._probs[idx_other];
-        last_point = other._masses[idx_other];
+        ret += (masses2[idx_other] - last_point) * acc_prob;
+        acc_prob -= probs2[idx_other];
+        last_point = masses2[idx_other];
         idx_other++;
     }
 
-    return ret;
+    return ret > bound ? std::numeric_limits<double>::infinity() : ret;
+}
+
+double FixedEnvelope::WassersteinDistance(FixedEnvelope& other)
+{
+    if((get_total_prob()*0.999 > other.get_total_prob()) || (other.get_total_prob() > get_total_prob()*1.001))
+        throw std::logic_error("Spectra must be normalized before computing Wasserstein Distance");
+
+    if(_confs_no == 0 || other._confs_no == 0)
+        return 0.0;
+
+    sort_by_mass();
+    other.sort_by_mass();
+
+    return wasserstein_kernel(_masses, _probs, _confs_no, other._masses, other._probs, other._confs_no, std::numeric_limits<double>::infinity());
 }
 
 
@@ -411,43 +785,24 @@ double FixedEnvelope::OrientedWassersteinDistance(FixedEnvelope& other)
     return ret;
 }
 
-double FixedEnvelope::AbyssalWassersteinDistance(FixedEnvelope& other, double abyss_depth, double other_scale)
+// The abyssal Wasserstein distance between two spectra sorted by mass, the second one scaled by other_scale. As in
+// wasserstein_kernel, the computation is abandoned as soon as the partial distance exceeds bound. carried is scratch space.
+static double abyssal_kernel(const double* masses1, const double* probs1, size_t n1,
+                             const double* masses2, const double* probs2, size_t n2,
+                             double abyss_depth, double other_scale, double bound,
+                             std::vector<std::pair<double, double>>& carried)
 {
-    sort_by_mass();
-    other.sort_by_mass();
-
-    std::vector<std::pair<double, double>> carried;
-
-    size_t idx_this = 0;
-    size_t idx_other = 0;
+    carried.clear();
 
-    //std::cout << "AAA" << std::endl;
-
-    auto finished = [&]() -> bool { return idx_this >= _confs_no && idx_other >= other._confs_no; };
-    auto next = [&]() -> std::pair<double, double> {
-                            if(idx_this >= _confs_no || (idx_other < other._confs_no && _masses[idx_this] > other._masses[idx_other]))
-                            {
-                                std::pair<double, double> res = std::pair<double, double>(other._masses[idx_other], other._probs[idx_other]*other_scale);
-                                idx_other++;
-                                return res;
-                            }
-                            else
-                            {
-                                std::pair<double, double> res = std::pair<double, double>(_masses[idx_this], -_probs[idx_this]);
-                                idx_this++;
-                                return res;
-                            }
-                        };
     double accd = 0.0;
     double condemned = 0.0;
 
-    while(!finished())
+    auto process = [&](double m, double p)
     {
-        auto [m, p] = next();
         if(!carried.empty() && carried[0].second * p > 0.0)
         {
             carried.emplace_back(m, p);
-            continue;
+            return;
         }
 
         while(!carried.empty())
@@ -476,251 +831,482 @@ double FixedEnvelope::AbyssalWassersteinDistance(FixedEnvelope& other, double ab
         }
         if(p != 0.0)
             carried.emplace_back(m, p);
-        //std::cout << m << " " << p << std::endl;
+    };
+
+    size_t idx_this = 0;
+    size_t idx_other = 0;
+
+    // Both accd and condemned only grow, so the partial distance is a lower bound on the final one
+    while(idx_this < n1 && idx_other < n2)
+    {
+        const bool from_other = masses1[idx_this] > masses2[idx_other];
+        process(from_other ? masses2[idx_other] : masses1[idx_this], from_other ? probs2[idx_other]*other_scale : -probs1[idx_this]);
+        idx_this += !from_other;
+        idx_other += from_other;
+        if(ISOSPEC_UNLIKELY(accd + condemned * abyss_depth * 0.5 > bound))
+            return std::numeric_limits<double>::infinity();
     }
 
+    for(; idx_this < n1; idx_this++)
+        process(masses1[idx_this], -probs1[idx_this]);
+
+    for(; idx_other < n2; idx_other++)
+        process(masses2[idx_other], probs2[idx_other]*other_scale);
+
     for(auto it = carried.cbegin(); it != carried.cend(); it++)
         condemned += fabs(it->second);
 
-    return accd + condemned * abyss_depth * 0.5;
+    const double ret = accd + condemned * abyss_depth * 0.5;
+    return ret > bound ? std::numeric_limits<double>::infinity() : ret;
 }
 
-#if 0
-double FixedEnvelope::ScaledAbyssalWassersteinDistance(FixedEnvelope * const * others, double abyss_depth, const double* other_scales, const size_t N)
+double FixedEnvelope::AbyssalWassersteinDistance(FixedEnvelope& other, double abyss_depth, double other_scale)
 {
     sort_by_mass();
+    other.sort_by_mass();
+
+    std::vector<std::pair<double, double>> carried;
+
+    return abyssal_kernel(_masses, _probs, _confs_no, other._masses, other._probs, other._confs_no,
+                          abyss_depth, other_scale, std::numeric_limits<double>::infinity(), carried);
+}
+
+namespace {
 
-    std::priority_queue<std::pair<double, size_t>> PQ;
-    std::unique_ptr<size_t[]> indices = std::make_unique<size_t[]>(N);
-    memset(indices.get(), 0, sizeof(size_t)*N);
+// The peaks of an envelope in the order of increasing mass: its own tables, if they're sorted that way, or a sorted copy
+class MassSortedPeaks
+{
+    std::vector<double> buffer;
+
+ public:
+    const double* masses;
+    const double* probs;
+    size_t size;
+
+    MassSortedPeaks() : masses(nullptr), probs(nullptr), size(0) {}
 
-    for(size_t ii=0; ii<N; ii++)
+    void set(const double* _masses, const double* _probs, size_t _size, bool sorted)
     {
-        others[ii]->sort_by_mass();
-        if(others[ii]->_confs_no > 0)
-            PQ.emplace_back({others._probs[0], ii});
+        size = _size;
+        if(sorted)
+        {
+            masses = _masses;
+            probs = _probs;
+            return;
+        }
+
+        std::unique_ptr<size_t[]> order(new size_t[size]);
+        radix_order_ascending(_masses, order.get(), size);
+        buffer.resize(2*size);
+        for(size_t ii = 0; ii < size; ii++)
+        {
+            buffer[ii] = _masses[order[ii]];
+            buffer[size+ii] = _probs[order[ii]];
+        }
+        masses = buffer.data();
+        probs = buffer.data() + size;
     }
+};
 
+}  // namespace
 
+template<typename Kernel> void FixedEnvelope::batch_distances(const FixedEnvelope* const* candidates, size_t N, double* ret, size_t best_k, unsigned int n_threads, Kernel&& kernel) const
+{
+    MassSortedPeaks query;
+    query.set(_masses, _probs, _confs_no, sorted_by_mass);
 
+    n_threads = static_cast<unsigned int>((std::min<size_t>)(resolve_threads_no(n_threads), (std::max<size_t>)(N, 1)));
 
-    std::vector<std::pair<double, double>> carried;
+    // Each thread keeps its own best_k distances: any of the overall best_k is among the best_k of the thread that
+    // computed it, so it's never abandoned.
+    struct ThreadState
+    {
+        MassSortedPeaks candidate;
+        std::priority_queue<double> best;
+    };
+    std::vector<ThreadState> states(n_threads);
 
-    size_t idx_this = 0;
-    size_t idx_other = 0;
+    parallel_for(N, n_threads, [&](size_t idx, unsigned int thread_idx)
+    {
+        ThreadState& state = states[thread_idx];
+        const FixedEnvelope& candidate = *candidates[idx];
+        state.candidate.set(candidate._masses, candidate._probs, candidate._confs_no, candidate.sorted_by_mass);
+
+        const double bound = (best_k > 0 && state.best.size() >= best_k) ? state.best.top() : std::numeric_limits<double>::infinity();
+        ret[idx] = kernel(query, state.candidate, bound);
+
+        if(best_k > 0 && ret[idx] < bound)
+        {
+            state.best.push(ret[idx]);
+            if(state.best.size() > best_k)
+                state.best.pop();
+        }
+    });
+}
+
+void FixedEnvelope::WassersteinDistances(const FixedEnvelope* const* candidates, size_t N, double* ret, size_t best_k, unsigned int n_threads) const
+{
+    double query_prob = 0.0;
+    for(size_t ii = 0; ii < _confs_no; ii++)
+        query_prob += _probs[ii];
 
-    //std::cout << "AAA" << std::endl;
-
-    auto finished = [&]() -> bool { return idx_this >= _confs_no && PQ.empty(); };
-    auto next = [&]() -> std::tuple<double, double, size_t> {
-                            if(idx_this >= _confs_no || (idx_other < other._confs_no && _masses[idx_this] > other._masses[idx_other]))
-                            {
-                                std::pair<double, double> res = std::pair<double, double>(other._masses[idx_other], other._probs[idx_other]*other_scale);
-                                idx_other++;
-                                return res;
-                            }
-                            else
-                            {
-                                std::pair<double, double> res = std::pair<double, double>(_masses[idx_this], -_probs[idx_this]);
-                                idx_this++;
-                                return res;
-                            }
-                        };
+    batch_distances(candidates, N, ret, best_k, n_threads, [query_prob](const MassSortedPeaks& query, const MassSortedPeaks& candidate, double bound)
+    {
+        double candidate_prob = 0.0;
+        for(size_t ii = 0; ii < candidate.size; ii++)
+            candidate_prob += candidate.probs[ii];
+
+        if((query_prob*0.999 > candidate_prob) || (candidate_prob > query_prob*1.001))
+            throw std::logic_error("Spectra must be normalized before computing Wasserstein Distance");
+
+        if(query.size == 0 || candidate.size == 0)
+            return 0.0;
+
+        return wasserstein_kernel(query.masses, query.probs, query.size, candidate.masses, candidate.probs, candidate.size, bound);
+    });
+}
+
+void FixedEnvelope::AbyssalWassersteinDistances(const FixedEnvelope* const* candidates, size_t N, double* ret, double abyss_depth,
+                                                double other_scale, size_t best_k, unsigned int n_threads) const
+{
+    batch_distances(candidates, N, ret, best_k, n_threads, [abyss_depth, other_scale](const MassSortedPeaks& query, const MassSortedPeaks& candidate, double bound)
+    {
+        thread_local std::vector<std::pair<double, double>> carried;
+        return abyssal_kernel(query.masses, query.probs, query.size, candidate.masses, candidate.probs, candidate.size,
+                              abyss_depth, other_scale, bound, carried);
+    });
+}
+
+// The greedy transport behind ScaledAbyssalWassersteinDistance, AbyssalWassersteinDistanceGrad and AbyssalFitContext.
+// next_peak(m, p, raw_prob, eidx) yields the peaks of all the K envelopes in the order of increasing mass, returning false
+// once they run out: eidx is the envelope the peak comes from (0 for the experimental one), raw_prob its signed probability
+// (negative for the experimental peaks) and p = raw_prob * scales[eidx]. They are transported as in abyssal_kernel - but
+// the probability flowing further than abyss_depth_exp + abyss_depth_the is condemned instead, at the cost of
+// abyss_depth_exp per unit of experimental and abyss_depth_the per unit of theoretical signal.
+//
+// If track_gradient, the derivative of the result for fixed transport decisions comes out in ret_gradient. A chunk of signal
+// is a sum of peaks, so its derivative w.r.t. scales[owner] is the sum of the raw_probs of its peaks from that envelope, and
+// each transport step adds it, times a factor, to ret_gradient. Instead of dense K-wide derivatives, every chunk keeps the
+// terms of its peaks and a weight, the sum of the factors applied to it so far: a term contributes coef * (weight - base)
+// to ret_gradient[owner], which is only done when the chunk is condemned. The terms of the carried chunks and of p lie
+// contiguously in terms, in the stack order, so merging two chunks rebases only the terms of the smaller one. The vectors
+// are scratch space.
+template<bool track_gradient, typename NextPeak> double AbyssalFitContext::abyssal_transport(size_t K, double abyss_depth_exp, double abyss_depth_the,
+                                                                                            NextPeak&& next_peak, double* ret_gradient,
+                                                                                            std::vector<std::pair<double, double>>& carried,
+                                                                                            std::vector<GradChunk>& carried_chunks,
+                                                                                            std::vector<GradTerm>& terms)
+{
+    carried.clear();
+    carried_chunks.clear();
+    terms.clear();
+
+    if constexpr(track_gradient)
+        memset(ret_gradient, 0, K*sizeof(double));
+
+    const double max_flow_dist = abyss_depth_exp + abyss_depth_the;
     double accd = 0.0;
     double condemned = 0.0;
 
-    while(!finished())
+    // The chunk of p: its terms are terms[p_chunk.start ..), and none between the peaks
+    GradChunk p_chunk{0, 0.0};
+
+    // Merge the terms [lo.start, hi.start) of lo with the following ones of hi (up to end) into lo, rebasing the fewer
+    auto merge_chunks = [&](GradChunk& lo, const GradChunk& hi, size_t end)
+    {
+        if(hi.start - lo.start <= end - hi.start)
+        {
+            for(size_t ii = lo.start; ii < hi.start; ii++)
+                terms[ii].base += hi.weight - lo.weight;
+            lo.weight = hi.weight;
+        }
+        else
+            for(size_t ii = hi.start; ii < end; ii++)
+                terms[ii].base += lo.weight - hi.weight;
+    };
+
+    // Negative chunks of signal are experimental, positive ones theoretical
+    auto condemn_carried = [&]()
+    {
+        for(size_t ii = 0; ii < carried.size(); ii++)
+        {
+            const double cp = carried[ii].second;
+            const double depth = cp < 0.0 ? abyss_depth_exp : abyss_depth_the;
+            condemned += fabs(cp) * depth;
+            if constexpr(track_gradient)
+            {
+                const double weight = carried_chunks[ii].weight + (cp < 0.0 ? -depth : depth);
+                const size_t end = ii+1 < carried.size() ? carried_chunks[ii+1].start : p_chunk.start;
+                for(size_t jj = carried_chunks[ii].start; jj < end; jj++)
+                    ret_gradient[terms[jj].owner] += terms[jj].coef * (weight - terms[jj].base);
+            }
+        }
+        if constexpr(track_gradient)
+        {
+            // Only the terms of p are left, move them down
+            terms.erase(terms.begin(), terms.begin() + p_chunk.start);
+            p_chunk.start = 0;
+            carried_chunks.clear();
+        }
+        carried.clear();
+    };
+
+    double m, p, raw_prob;
+    size_t eidx;
+
+    while(next_peak(m, p, raw_prob, eidx))
     {
-        auto [m, p] = next();
+        if constexpr(track_gradient)
+            terms.push_back(GradTerm{static_cast<unsigned int>(eidx), raw_prob, 0.0});
+
         if(!carried.empty() && carried[0].second * p > 0.0)
         {
             carried.emplace_back(m, p);
+            if constexpr(track_gradient)
+            {
+                carried_chunks.push_back(p_chunk);
+                p_chunk = GradChunk{terms.size(), 0.0};
+            }
             continue;
         }
 
         while(!carried.empty())
         {
             auto& [cm, cp] = carried.back();
-            if(m - cm >= abyss_depth)
+            if(m - cm >= max_flow_dist)
             {
-                for(auto it = carried.cbegin(); it != carried.cend(); it++)
-                    condemned += fabs(it->second);
-                carried.clear();
+                condemn_carried();
                 break;
             }
             if((cp+p)*p > 0.0)
             {
                 accd += fabs((m-cm)*cp);
+                if constexpr(track_gradient)
+                {
+                    GradChunk cp_chunk = carried_chunks.back();
+                    cp_chunk.weight += cp < 0.0 ? cm-m : m-cm;
+                    merge_chunks(cp_chunk, p_chunk, terms.size());
+                    p_chunk = cp_chunk;
+                    carried_chunks.pop_back();
+                }
                 p += cp;
                 carried.pop_back();
             }
             else
             {
                 accd += fabs((m-cm)*p);
+                if constexpr(track_gradient)
+                {
+                    p_chunk.weight += p < 0.0 ? cm-m : m-cm;
+                    merge_chunks(carried_chunks.back(), p_chunk, terms.size());
+                    p_chunk = GradChunk{terms.size(), 0.0};
+                }
                 cp += p;
                 p = 0.0;
                 break;
             }
         }
         if(p != 0.0)
+        {
             carried.emplace_back(m, p);
-        //std::cout << m << " " << p << std::endl;
+            if constexpr(track_gradient)
+                carried_chunks.push_back(p_chunk);
+        }
+        else if constexpr(track_gradient)
+            terms.resize(p_chunk.start);
+        if constexpr(track_gradient)
+            p_chunk = GradChunk{terms.size(), 0.0};
     }
 
-    for(auto it = carried.cbegin(); it != carried.cend(); it++)
-        condemned += fabs(it->second);
+    condemn_carried();
 
-    return accd + condemned * abyss_depth * 0.5;
+    return accd + condemned;
 }
 
-#endif
-
-#if 0
-double AbyssalWassersteinDistanceGrad(FixedEnvelope* const* envelopes, const double* scales, double* ret_gradient, size_t N, double abyss_depth_exp, double abyss_depth_the)
+// Feed the peaks of envelopes[0..N] to abyssal_transport through a heap, in the order of increasing mass, the peaks of
+// envelopes with lower indices first on ties.
+template<bool track_gradient> double AbyssalFitContext::abyssal_merge(FixedEnvelope* const* envelopes, const double* scales, size_t N,
+                                                                     double abyss_depth_exp, double abyss_depth_the, double* ret_gradient)
 {
-return 0.0;
-    std::unique_ptr<size_t[]> env_idx = std::make_unique<size_t[]>(N+1);
-    memset(env_idx.get(), 0, (N+1)*sizeof(size_t));
-    memset(ret_gradient, 0, (N+1)*sizeof(double));
+    const size_t K = N+1;
+    std::unique_ptr<size_t[]> env_idx(new size_t[K]);
 
-    auto pq_cmp = [](std::pair<double, size_t>& p1, std::pair<double, size_t>& p2) { return p1.first > p2.first; };
+    auto pq_cmp = [](const std::pair<double, size_t>& p1, const std::pair<double, size_t>& p2)
+                  { return p1.first > p2.first || (p1.first == p2.first && p1.second > p2.second); };
     std::priority_queue<std::pair<double, size_t>, std::vector<std::pair<double, size_t>>, decltype(pq_cmp)> PQ(pq_cmp);
 
-    for(size_t ii=0; ii<=N; ii++)
+    for(size_t ii = 0; ii < K; ii++)
     {
         envelopes[ii]->sort_by_mass();
-        if(envelopes[ii]->_confs_no > 0)
-        {
-            std::cout << "Initial push: " << envelopes[ii]->_masses[0] << " " << ii << '\n';
-            PQ.push({envelopes[ii]->_masses[0], ii});
-        }
+        env_idx[ii] = 0;
+        if(envelopes[ii]->confs_no() > 0)
+            PQ.push({envelopes[ii]->mass(0), ii});
     }
 
-    std::vector<std::tuple<double, double, size_t>> carried;
-
-    auto next = [&]() -> std::tuple<double, double, size_t> {
-                            auto [mass, eidx] = PQ.top();
-                            double prob = envelopes[eidx]->_probs[env_idx[eidx]];
-                            PQ.pop();
-                            if(eidx == 0)
-                                prob = -prob;
-                            else
-                                prob = prob * scales[eidx];
-                            std::cout << "Next: " << mass << " " << prob << " " << eidx << '\n';
-                            env_idx[eidx]++;
-                            if(env_idx[eidx] < envelopes[eidx]->_confs_no)
-                                PQ.push({envelopes[eidx]->_masses[env_idx[eidx]], eidx});
-
-                            return {mass, prob, eidx};
-                        };
-    double accd = 0.0;
-    double condemned = 0.0;
-    //double flow;
-    const double max_flow_dist = abyss_depth_exp + abyss_depth_the;
-    max_flow_dist *= 2.0;
+    auto next_peak = [&](double& m, double& p, double& raw_prob, size_t& eidx)
+    {
+        if(PQ.empty())
+            return false;
+        std::tie(m, eidx) = PQ.top();
+        PQ.pop();
+        const FixedEnvelope& envelope = *envelopes[eidx];
+        raw_prob = eidx == 0 ? -envelope.prob(env_idx[eidx]) : envelope.prob(env_idx[eidx]);
+        p = raw_prob * scales[eidx];
+        env_idx[eidx]++;
+        if(env_idx[eidx] < envelope.confs_no())
+            PQ.push({envelope.mass(env_idx[eidx]), eidx});
+        return true;
+    };
 
-    while(!PQ.empty())
+    std::vector<std::pair<double, double>> carried;
+    std::vector<GradChunk> carried_chunks;
+    std::vector<GradTerm> terms;
+
+    return abyssal_transport<track_gradient>(K, abyss_depth_exp, abyss_depth_the, next_peak, ret_gradient, carried, carried_chunks, terms);
+}
+
+double FixedEnvelope::ScaledAbyssalWassersteinDistance(FixedEnvelope* const* others, double abyss_depth, const double* other_scales, size_t N)
+{
+    std::vector<FixedEnvelope*> envelopes(N+1);
+    std::vector<double> scales(N+1);
+    envelopes[0] = this;
+    scales[0] = 1.0;
+    for(size_t ii = 0; ii < N; ii++)
     {
-        auto [m, p, eidx] = next();
-        if(!carried.empty() && std::get<1>(carried[0]) * p > 0.0)
-        {
-            carried.emplace_back(m, p, eidx);
-            continue;
-        }
+        envelopes[ii+1] = others[ii];
+        scales[ii+1] = other_scales[ii];
+    }
 
-        while(!carried.empty())
+    return AbyssalFitContext::abyssal_merge<false>(envelopes.data(), scales.data(), N, abyss_depth * 0.5, abyss_depth * 0.5, nullptr);
+}
+
+double AbyssalWassersteinDistanceGrad(FixedEnvelope* const* envelopes, const double* scales, double* ret_gradient, size_t N, double abyss_depth_exp, double abyss_depth_the)
+{
+    return AbyssalFitContext::abyssal_merge<true>(envelopes, scales, N, abyss_depth_exp, abyss_depth_the, ret_gradient);
+}
+
+AbyssalFitContext::AbyssalFitContext(const FixedEnvelope* const* envelopes, size_t N, double _abyss_depth_exp, double _abyss_depth_the) :
+K(N+1),
+abyss_depth_exp(_abyss_depth_exp),
+abyss_depth_the(_abyss_depth_the)
+{
+    size_t total_peaks = 0;
+    for(size_t ii = 0; ii < K; ii++)
+        total_peaks += envelopes[ii]->confs_no();
+
+    // Concatenated envelope by envelope, and then stably sorted by mass: ties are broken as in abyssal_merge
+    std::vector<double> all_masses;
+    std::vector<double> all_probs;
+    std::vector<unsigned int> all_owners;
+    all_masses.reserve(total_peaks);
+    all_probs.reserve(total_peaks);
+    all_owners.reserve(total_peaks);
+
+    for(size_t ii = 0; ii < K; ii++)
+    {
+        const FixedEnvelope& envelope = *envelopes[ii];
+        for(size_t jj = 0; jj < envelope.confs_no(); jj++)
         {
-            auto& [cm, cp, ceidx] = carried.back();
-            if(m - cm >= max_flow_dist)
-            {
-                for(auto it = carried.cbegin(); it != carried.cend(); it++)
-                    condemned += fabs(std::get<1>(*it));
-                carried.clear();
-                break;
-            }
-            std::cout << "accing\n";
-            if((cp+p)*p > 0.0)
-            {
-                accd += fabs((m-cm)*cp);
-                p += cp;
-                carried.pop_back();
-                std::cout << "cprob:" << cp << '\n';
-            }
-            else
-            {
-                accd += fabs((m-cm)*p);
-                cp += p;
-                std::cout << "prob:" << p << '\n';
-                p = 0.0;
-                break;
-            }
+            all_masses.push_back(envelope.mass(jj));
+            all_probs.push_back(ii == 0 ? -envelope.prob(jj) : envelope.prob(jj));
+            all_owners.push_back(static_cast<unsigned int>(ii));
         }
-        if(p != 0.0)
-            carried.emplace_back(m, p, eidx);
-        //std::cout << m << " " << p << std::endl;
     }
 
-    for(auto it = carried.cbegin(); it != carried.cend(); it++)
-        condemned += fabs(std::get<1>(*it));
+    std::unique_ptr<size_t[]> order(new size_t[total_peaks]);
+    radix_order_ascending(all_masses.data(), order.get(), total_peaks);
+
+    masses.resize(total_peaks);
+    raw_probs.resize(total_peaks);
+    owners.resize(total_peaks);
+    for(size_t ii = 0; ii < total_peaks; ii++)
+    {
+        masses[ii] = all_masses[order[ii]];
+        raw_probs[ii] = all_probs[order[ii]];
+        owners[ii] = all_owners[order[ii]];
+    }
+
+    scaled_probs.resize(total_peaks);
+}
+
+template<bool track_gradient> double AbyssalFitContext::evaluate_impl(const double* scales, double* ret_gradient)
+{
+    const size_t total_peaks = masses.size();
+
+    for(size_t ii = 0; ii < total_peaks; ii++)
+        scaled_probs[ii] = raw_probs[ii] * scales[owners[ii]];
+
+    size_t idx = 0;
+    auto next_peak = [&](double& m, double& p, double& raw_prob, size_t& eidx)
+    {
+        if(idx >= total_peaks)
+            return false;
+        m = masses[idx];
+        p = scaled_probs[idx];
+        raw_prob = raw_probs[idx];
+        eidx = owners[idx];
+        idx++;
+        return true;
+    };
+
+    return abyssal_transport<track_gradient>(K, abyss_depth_exp, abyss_depth_the, next_peak, ret_gradient, carried, carried_chunks, terms);
+}
+
+double AbyssalFitContext::evaluate(const double* scales, double* ret_gradient)
+{
+    if(ret_gradient == nullptr)
+        return evaluate_impl<false>(scales, nullptr);
+    return evaluate_impl<true>(scales, ret_gradient);
+}
+
+double AbyssalFitContext::fit(double* scales, size_t max_iterations, double tolerance)
+{
+    std::vector<double> gradient(K);
+    std::vector<double> candidate(K);
+    std::vector<double> candidate_gradient(K);
+
+    for(size_t ii = 1; ii < K; ii++)
+        scales[ii] = (std::max)(scales[ii], 0.0);
+
+    double current = evaluate(scales, gradient.data());
 
-    std::cout << "ISO:" << accd << " " << condemned << '\n';
-    return accd + condemned * max_flow_dist * 0.5;
-    while(!PQ.empty())
+    // The step is the largest change of a single scale: it's grown after every successful step, and shrunk after a failed one
+    double step = 0.0;
+    for(size_t ii = 1; ii < K; ii++)
+        step = (std::max)(step, scales[ii]);
+    if(step == 0.0)
+        step = 1.0;
+    const double min_step = tolerance * step;
+
+    for(size_t iteration = 0; iteration < max_iterations && step >= min_step; iteration++)
     {
-        auto [m, p, eidx] = next();
-        if(!carried.empty() && (std::get<1>(carried[0]) * p > 0.0))
-        {
-            carried.emplace_back(m, p, eidx);
-            continue;
-        }
+        double max_grad = 0.0;
+        for(size_t ii = 1; ii < K; ii++)
+            if(scales[ii] > 0.0 || gradient[ii] < 0.0)
+                max_grad = (std::max)(max_grad, fabs(gradient[ii]));
 
-        while(!carried.empty())
+        if(max_grad == 0.0)
+            break;
+
+        candidate[0] = scales[0];
+        for(size_t ii = 1; ii < K; ii++)
+            candidate[ii] = (std::max)(scales[ii] - step * gradient[ii] / max_grad, 0.0);
+
+        const double value = evaluate(candidate.data(), candidate_gradient.data());
+
+        if(value < current)
         {
-            auto& [cm, cp, ceidx] = carried.back();
-            if(m - cm >= max_flow_dist)
-            {
-                for(auto it = carried.cbegin(); it != carried.cend(); it++)
-                {
-                    flow = fabs(std::get<1>(*it));
-                    const size_t target_idx = std::get<2>(*it);
-                    flow *= target_idx == 0 ? abyss_depth_exp : abyss_depth_the;
-                    ret_gradient[target_idx] += flow;
-                    condemned += flow;
-                    std::cout << "condemnin': " << m << " " << p << " " << eidx << " | " << cm << " " << cp << " " << ceidx << '\n';
-                }
-                carried.clear();
-                break;
-            }
-            if((cp+p)*p > 0.0)
-            {
-                flow = fabs((m-cm)*cp);
-                accd += flow;
-                p += cp;
-                ret_gradient[ceidx] += flow;
-                carried.pop_back();
-            }
-            else
-            {
-                flow = fabs((m-cm)*p);
-                accd += flow;
-                cp += p;
-                ret_gradient[eidx] += flow;
-                p = 0.0;
-                break;
-            }
+            current = value;
+            memcpy(scales + 1, candidate.data() + 1, (K-1)*sizeof(double));
+            gradient.swap(candidate_gradient);
+            step *= 2.0;
         }
-        if(p != 0.0)
-            carried.emplace_back(m, p, eidx);
-        //std::cout << m << " " << p << std::endl;
+        else
+            step *= 0.5;
     }
 
-    for(auto it = carried.cbegin(); it != carried.cend(); it++)
-        condemned += fabs(std::get<1>(*it));
-
-
-    return accd + condemned * (abyss_depth_exp + abyss_depth_the) * 0.5;
+    return current;
 }
-#endif
 
 
 std::tuple<double, double, double> FixedEnvelope::WassersteinMatch(FixedEnvelope& other, double flow_distance, double other_scale)
@@ -894,44 +1480,115 @@ void FixedEnvelope::slow_reallocate_memory(size_t new_size)
     }
 }
 
-template<bool tgetConfs> void FixedEnvelope::threshold_init(Iso&& iso, double threshold, bool absolute)
+template<bool tgetConfs> void FixedEnvelope::threshold_init(Iso&& iso, double threshold, bool absolute, unsigned int n_threads)
 {
     IsoThresholdGenerator generator(std::move(iso), threshold, absolute);
 
-    size_t tab_size = generator.count_confs();
     this->allDim = generator.getAllDim();
     this->allDimSizeofInt = this->allDim * sizeof(int);
 
-    this->reallocate_memory<tgetConfs>(tab_size);
-
-    double* ttmasses = this->_masses;
-    double* ttprobs = this->_probs;
-    ISOSPEC_MAYBE_UNUSED int* ttconfs;
-    constexpr_if(tgetConfs)
-        ttconfs = _confs;
+    n_threads = resolve_threads_no(n_threads);
 
-    while(generator.advanceToNextConfiguration())
+    if(n_threads > 1 && generator.getDimNumber() > 1)
     {
-        *ttmasses = generator.mass(); ttmasses++;
-        *ttprobs = generator.prob(); ttprobs++;
-        constexpr_if(tgetConfs)  { generator.get_conf_signature(ttconfs); ttconfs += allDim; }
+        parallel_threshold_fill<tgetConfs>(generator, n_threads);
+        return;
     }
 
+    size_t tab_size = generator.count_confs();
+
+    this->reallocate_memory<tgetConfs>(tab_size);
+
+    this->store_runs<IsoThresholdGenerator, tgetConfs>(generator, this->_masses, this->_probs, this->_confs);
+
     this->_confs_no = tab_size;
 }
 
-template void FixedEnvelope::threshold_init<true>(Iso&& iso, double threshold, bool absolute);
-template void FixedEnvelope::threshold_init<false>(Iso&& iso, double threshold, bool absolute);
+template void FixedEnvelope::threshold_init<true>(Iso&& iso, double threshold, bool absolute, unsigned int n_threads);
+template void FixedEnvelope::threshold_init<false>(Iso&& iso, double threshold, bool absolute, unsigned int n_threads);
+
+template<bool tgetConfs> void FixedEnvelope::parallel_threshold_fill(IsoThresholdGenerator& generator, unsigned int n_threads)
+{
+    // Split the space into work ranges, count the configurations in each one, and then let every range
+    // write its configurations directly into its place in the output table.
+    const int split_dim = generator.choose_split_dim(ISOSPEC_WORK_RANGES_PER_THREAD * static_cast<size_t>(n_threads));
+    const size_t width = generator.getDimNumber() - split_dim;
+    const std::vector<int> ranges = generator.get_work_ranges(split_dim);
+    const size_t no_ranges = ranges.size() / width;
+
+    std::vector<std::unique_ptr<IsoThresholdGenerator> > workers(n_threads);
+
+    auto get_worker = [&](size_t range_idx, unsigned int thread_idx) -> IsoThresholdGenerator&
+    {
+        const int* range = ranges.data() + range_idx * width;
+        if(workers[thread_idx])
+            workers[thread_idx]->restrict_to_range(split_dim, range);
+        else
+            workers[thread_idx].reset(new IsoThresholdGenerator(generator, split_dim, range));
+        return *workers[thread_idx];
+    };
+
+    std::unique_ptr<size_t[]> offsets(new size_t[no_ranges+1]);
+    offsets[0] = 0;
+
+    parallel_for(no_ranges, n_threads, [&](size_t range_idx, unsigned int thread_idx)
+    {
+        offsets[range_idx+1] = get_worker(range_idx, thread_idx).count_confs();
+    });
+
+    for(size_t ii = 0; ii < no_ranges; ii++)
+        offsets[ii+1] += offsets[ii];
+
+    this->reallocate_memory<tgetConfs>(offsets[no_ranges]);
+
+    parallel_for(no_ranges, n_threads, [&](size_t range_idx, unsigned int thread_idx)
+    {
+        this->store_runs<IsoThresholdGenerator, tgetConfs>(
+            get_worker(range_idx, thread_idx),
+            this->_masses + offsets[range_idx],
+            this->_probs + offsets[range_idx],
+            tgetConfs ? this->_confs + offsets[range_idx] * this->allDim : nullptr);
+    });
+
+    this->_confs_no = offsets[no_ranges];
+}
+
+
+template<bool tgetConfs> size_t FixedEnvelope::partition_by_prob(size_t start, size_t end, int* conf_swapspace, double& csum)
+{
+    size_t len = end - start;
+#if ISOSPEC_BUILDING_R
+    size_t pivot = len/2 + start;
+#else
+    size_t pivot = random_gen() % len + start;  // Using Mersenne twister directly - we don't
+                                                // need a very uniform distribution just for pivot
+                                                // selection
+#endif
+    double pprob = this->_probs[pivot];
+    swap<tgetConfs>(pivot, end-1, conf_swapspace);
+
+    size_t loweridx = start;
+    for(size_t ii = start; ii < end-1; ii++)
+        if(this->_probs[ii] > pprob)
+        {
+            swap<tgetConfs>(ii, loweridx, conf_swapspace);
+            csum += this->_probs[loweridx];
+            loweridx++;
+        }
+
+    swap<tgetConfs>(end-1, loweridx, conf_swapspace);
 
+    return loweridx;
+}
 
-template<bool tgetConfs> void FixedEnvelope::total_prob_init(Iso&& iso, double target_total_prob, bool optimize)
+template<bool tgetConfs> void FixedEnvelope::total_prob_init(Iso&& iso, double target_total_prob, bool optimize, unsigned int n_threads)
 {
     if(target_total_prob <= 0.0)
         return;
 
     if(target_total_prob >= 1.0)
     {
-        threshold_init<tgetConfs>(std::move(iso), 0.0, true);
+        threshold_init<tgetConfs>(std::move(iso), 0.0, true, n_threads);
         return;
     }
 
@@ -950,27 +1607,51 @@ template<bool tgetConfs> void FixedEnvelope::total_prob_init(Iso&& iso, double t
 
     const double sum_above = log1p(-target_total_prob) - 2.3025850929940455;  // log(0.1);
 
+    n_threads = resolve_threads_no(n_threads);
+    const bool parallel = n_threads > 1 && generator.getDimNumber() > 1;
+
     do
-    {  // Store confs until we accumulate more prob than needed - and, if optimizing,
-       // store also the rest of the last layer
-        while(generator.advanceToNextConfigurationWithinLayer())
+    {
+        if(parallel)
         {
-            this->template addConfILG<tgetConfs>(generator);
-            prob_so_far += *(tprobs-1);  // The just-stored probability
+            // Store the whole layer, then go through it as the serial path would, to stop at the very same configuration
+            size_t ii = this->_confs_no;
+            parallel_layer_fill<tgetConfs>(generator, n_threads);
+            while(ii < this->_confs_no && prob_so_far < target_total_prob)
+                prob_so_far += this->_probs[ii++];
+
             if(prob_so_far >= target_total_prob)
             {
-                if (optimize)
+                if(!optimize)
                 {
-                    while(generator.advanceToNextConfigurationWithinLayer())
-                        this->template addConfILG<tgetConfs>(generator);
-                    break;
+                    this->_confs_no = ii;
+                    return;
                 }
-                else
+                break;
+            }
+        }
+        else
+        {
+            // Store confs until we accumulate more prob than needed - and, if optimizing,
+            // store also the rest of the last layer
+            generator.for_each_conf_within_layer([&](const IsoLayeredGenerator& gen)
+            {
+                this->template addConfILG<tgetConfs>(gen);
+                prob_so_far += *(tprobs-1);  // The just-stored probability
+                return prob_so_far < target_total_prob;
+            });
+            if(prob_so_far >= target_total_prob)
+            {
+                if(!optimize)
                     return;
+                generator.for_each_conf_within_layer([&](const IsoLayeredGenerator& gen)
+                {
+                    this->template addConfILG<tgetConfs>(gen);
+                    return true;
+                });
+                break;
             }
         }
-        if(prob_so_far >= target_total_prob)
-            break;
 
         last_switch = this->_confs_no;
         prob_at_last_switch = prob_so_far;
@@ -998,30 +1679,8 @@ template<bool tgetConfs> void FixedEnvelope::total_prob_init(Iso&& iso, double t
 
     while(start < end)
     {
-        // Partition part
-        size_t len = end - start;
-#if ISOSPEC_BUILDING_R
-        size_t pivot = len/2 + start;
-#else
-        size_t pivot = random_gen() % len + start;  // Using Mersenne twister directly - we don't
-                                                    // need a very uniform distribution just for pivot
-                                                    // selection
-#endif
-        double pprob = this->_probs[pivot];
-        swap<tgetConfs>(pivot, end-1, conf_swapspace);
-
         double new_csum = sum_to_start;
-
-        size_t loweridx = start;
-        for(size_t ii = start; ii < end-1; ii++)
-            if(this->_probs[ii] > pprob)
-            {
-                swap<tgetConfs>(ii, loweridx, conf_swapspace);
-                new_csum += this->_probs[loweridx];
-                loweridx++;
-            }
-
-        swap<tgetConfs>(end-1, loweridx, conf_swapspace);
+        size_t loweridx = partition_by_prob<tgetConfs>(start, end, conf_swapspace, new_csum);
 
         // Selection part
         if(new_csum < target_total_prob)
@@ -1043,8 +1702,182 @@ template<bool tgetConfs> void FixedEnvelope::total_prob_init(Iso&& iso, double t
     this->_confs_no = end;
 }
 
-template void FixedEnvelope::total_prob_init<true>(Iso&& iso, double target_total_prob, bool optimize);
-template void FixedEnvelope::total_prob_init<false>(Iso&& iso, double target_total_prob, bool optimize);
+template void FixedEnvelope::total_prob_init<true>(Iso&& iso, double target_total_prob, bool optimize, unsigned int n_threads);
+template void FixedEnvelope::total_prob_init<false>(Iso&& iso, double target_total_prob, bool optimize, unsigned int n_threads);
+
+template<bool tgetConfs> void FixedEnvelope::parallel_layer_fill(IsoLayeredGenerator& generator, unsigned int n_threads)
+{
+    // Same as parallel_threshold_fill, except that the configurations of the current layer are appended to
+    // the ones already stored, and that the workers are invalidated by the next layer.
+    const int split_dim = generator.choose_split_dim(ISOSPEC_WORK_RANGES_PER_THREAD * static_cast<size_t>(n_threads));
+    const size_t width = generator.getDimNumber() - split_dim;
+    const std::vector<int> ranges = generator.get_work_ranges(split_dim);
+    const size_t no_ranges = ranges.size() / width;
+
+    std::vector<std::unique_ptr<IsoLayeredGenerator> > workers(n_threads);
+
+    auto get_worker = [&](size_t range_idx, unsigned int thread_idx) -> IsoLayeredGenerator&
+    {
+        const int* range = ranges.data() + range_idx * width;
+        if(workers[thread_idx])
+            workers[thread_idx]->restrict_to_range(split_dim, range);
+        else
+            workers[thread_idx].reset(new IsoLayeredGenerator(generator, split_dim, range));
+        return *workers[thread_idx];
+    };
+
+    std::unique_ptr<size_t[]> offsets(new size_t[no_ranges+1]);
+    offsets[0] = this->_confs_no;
+
+    parallel_for(no_ranges, n_threads, [&](size_t range_idx, unsigned int thread_idx)
+    {
+        IsoLayeredGenerator& worker = get_worker(range_idx, thread_idx);
+        size_t count = 0;
+        while(worker.advanceToNextRunWithinLayer())
+            count += worker.run_end() - worker.run_begin();
+        offsets[range_idx+1] = count;
+    });
+
+    for(size_t ii = 0; ii < no_ranges; ii++)
+        offsets[ii+1] += offsets[ii];
+
+    if(offsets[no_ranges] > this->current_size)
+        this->reallocate_memory<tgetConfs>((std::max)(offsets[no_ranges], 2*this->current_size));
+
+    parallel_for(no_ranges, n_threads, [&](size_t range_idx, unsigned int thread_idx)
+    {
+        this->store_runs<IsoLayeredGenerator, tgetConfs>(
+            get_worker(range_idx, thread_idx),
+            this->_masses + offsets[range_idx],
+            this->_probs + offsets[range_idx],
+            tgetConfs ? this->_confs + offsets[range_idx] * this->allDim : nullptr);
+    });
+
+    this->_confs_no = offsets[no_ranges];
+    this->tmasses = this->_masses + this->_confs_no;
+    this->tprobs = this->_probs + this->_confs_no;
+    constexpr_if(tgetConfs)
+        this->tconfs = this->_confs + this->allDim * this->_confs_no;
+}
+
+template<bool tgetConfs> void FixedEnvelope::window_init(Iso&& iso, double mmin, double mmax, double threshold, bool absolute)
+{
+    IsoWindowGenerator generator(std::move(iso), mmin, mmax, threshold, absolute);
+
+    this->allDim = generator.getAllDim();
+    this->allDimSizeofInt = this->allDim * sizeof(int);
+
+    this->reallocate_memory<tgetConfs>(ISOSPEC_INIT_TABLE_SIZE);
+
+    generator.for_each_conf([&](const IsoWindowGenerator& gen)
+    {
+        this->template addConfILG<tgetConfs, IsoWindowGenerator>(gen);
+        return true;
+    });
+}
+
+template void FixedEnvelope::window_init<true>(Iso&& iso, double mmin, double mmax, double threshold, bool absolute);
+template void FixedEnvelope::window_init<false>(Iso&& iso, double mmin, double mmax, double threshold, bool absolute);
+
+template<bool tgetConfs> void FixedEnvelope::topk_init(Iso&& iso, size_t K)
+{
+    this->allDim = iso.getAllDim();
+    this->allDimSizeofInt = this->allDim * sizeof(int);
+
+    if(K == 0)
+        return;
+
+    // Find a threshold (relative to the mode, in log space) with at least K configurations above it, but not many
+    // more: first going down in exponentially growing steps, then bisecting. Only the counts are needed for that,
+    // so the marginals are built without masses and probabilities, and the counting gives up past max_count, so that
+    // a too low threshold doesn't cost more than a good one.
+    const size_t max_count = K > (std::numeric_limits<size_t>::max)() / 2 ? (std::numeric_limits<size_t>::max)() : 2 * K;
+
+    auto count_above = [&](double log_threshold)
+    {
+        IsoThresholdGenerator generator(Iso(iso, true), exp(log_threshold), false, 1000, 1000, true, true);
+        return generator.count_confs(max_count);
+    };
+
+    double hi = 0.0;  // Fewer than K configurations above, unless hi == lo == 0.0
+    double lo = 0.0;  // At least K configurations above
+    size_t lo_count = count_above(lo);
+    double step = 1.0;
+
+    while(lo_count < K)
+    {
+        hi = lo;
+        lo = -step;
+        step *= 2.0;
+        if(lo < ISOSPEC_TOPK_MIN_LOG_THRESHOLD)
+        {
+            // There are fewer than K configurations above any meaningful threshold: take them all
+            lo = -std::numeric_limits<double>::infinity();
+            break;
+        }
+        lo_count = count_above(lo);
+    }
+
+    while(lo_count > max_count && lo > -std::numeric_limits<double>::infinity())
+    {
+        const double mid = (lo + hi) / 2.0;
+        if(mid <= lo || mid >= hi)
+            break;  // Lots of configurations tied at the boundary
+        const size_t mid_count = count_above(mid);
+        if(mid_count >= K)
+        {
+            lo = mid;
+            lo_count = mid_count;
+        }
+        else
+            hi = mid;
+    }
+
+    IsoThresholdGenerator generator(std::move(iso), exp(lo), false);
+
+    const size_t tab_size = generator.count_confs();
+
+    this->reallocate_memory<tgetConfs>(tab_size);
+
+    this->store_runs<IsoThresholdGenerator, tgetConfs>(generator, this->_masses, this->_probs, this->_confs);
+
+    this->_confs_no = tab_size;
+
+    if(tab_size <= K)
+        return;
+
+    // Now quickselect the K most probable configurations, the same way as quicktrim in total_prob_init does,
+    // except that the position of the pivot, and not the sum of probabilities before it, decides which way to go.
+    int* conf_swapspace = nullptr;
+    constexpr_if(tgetConfs)
+        conf_swapspace = reinterpret_cast<int*>(malloc(this->allDimSizeofInt));
+
+    size_t start = 0;
+    size_t end = tab_size;
+    double unused_csum = 0.0;
+
+    while(start < end)
+    {
+        size_t pivot = partition_by_prob<tgetConfs>(start, end, conf_swapspace, unused_csum);
+
+        if(pivot < K)
+            start = pivot + 1;
+        else
+            end = pivot;
+    }
+
+    constexpr_if(tgetConfs)
+        free(conf_swapspace);
+
+    this->_confs_no = K;
+
+    if(K <= current_size/2)
+        // Overhead in memory of 2x or more, shrink to fit
+        this->template reallocate_memory<tgetConfs>(K);
+}
+
+template void FixedEnvelope::topk_init<true>(Iso&& iso, size_t K);
+template void FixedEnvelope::topk_init<false>(Iso&& iso, size_t K);
 
 template<bool tgetConfs> void FixedEnvelope::stochastic_init(Iso&& iso, size_t _no_molecules, double _precision, double _beta_bias)
 {
@@ -1055,13 +1888,168 @@ template<bool tgetConfs> void FixedEnvelope::stochastic_init(Iso&& iso, size_t _
 
     this->reallocate_memory<tgetConfs>(ISOSPEC_INIT_TABLE_SIZE);
 
-    while(generator.advanceToNextConfiguration())
-        addConfILG<tgetConfs, IsoStochasticGenerator>(generator);
+    generator.for_each_conf([&](const IsoStochasticGenerator& gen)
+    {
+        this->template addConfILG<tgetConfs, IsoStochasticGenerator>(gen);
+        return true;
+    });
 }
 
 template void FixedEnvelope::stochastic_init<true>(Iso&& iso, size_t _no_molecules, double _precision, double _beta_bias);
 template void FixedEnvelope::stochastic_init<false>(Iso&& iso, size_t _no_molecules, double _precision, double _beta_bias);
 
+// Distribute no_molecules multinomially among the configurations with the given probabilities, summing up to total_prob,
+// overwriting the probabilities with the counts. Where few molecules are expected per configuration, jump straight to
+// the one holding the next molecule, just as IsoStochasticGenerator does.
+static void sample_counts(double* probs, size_t no_confs, double total_prob, size_t no_molecules, double beta_bias, std::mt19937& rgen)
+{
+    // Binomial variate with the success probability num/den, robust to rounding errors at the end of the table
+    auto binom = [&rgen](size_t tries, double num, double den) { return num >= den ? tries : rdvariate_binom(tries, num/den, rgen); };
+
+    size_t ii = 0;
+    size_t left = no_molecules;
+    double prob_left = total_prob;
+
+    while(left > 0 && ii + 1 < no_confs)
+    {
+        double prob = probs[ii];
+        size_t count;
+
+        if(static_cast<double>(left) * prob <= beta_bias * prob_left)
+        {
+            // The position of the first of the remaining molecules within the remaining probability
+            double offset = rdvariate_beta_1_b(static_cast<double>(left), rgen) * prob_left;
+            while(offset >= prob && ii + 1 < no_confs)
+            {
+                probs[ii] = 0.0;
+                offset -= prob;
+                prob_left -= prob;
+                ii++;
+                prob = probs[ii];
+            }
+            if(ii + 1 == no_confs)
+                break;
+            // The first molecule lands here, the rest are spread uniformly over the probability past it
+            count = 1 + binom(left - 1, prob - offset, prob_left - offset);
+        }
+        else
+            count = binom(left, prob, prob_left);
+
+        probs[ii] = static_cast<double>(count);
+        left -= count;
+        prob_left -= prob;
+        ii++;
+    }
+
+    if(ii < no_confs)
+        probs[ii++] = static_cast<double>(left);
+
+    for(; ii < no_confs; ii++)
+        probs[ii] = 0.0;
+}
+
+static std::mt19937 seeded_stream(uint64_t seed, const std::vector<uint32_t>& stream_id)
+{
+    std::vector<uint32_t> seed_data{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)};
+    seed_data.insert(seed_data.end(), stream_id.begin(), stream_id.end());
+    std::seed_seq seq(seed_data.begin(), seed_data.end());
+    return std::mt19937(seq);
+}
+
+template<bool tgetConfs> void FixedEnvelope::seeded_stochastic_init(Iso&& iso, size_t _no_molecules, uint64_t seed, double _precision, double _beta_bias, unsigned int n_threads)
+{
+    if(_precision > 1.0)
+        _precision = 1.0;
+
+    this->total_prob_init<tgetConfs>(std::move(iso), _precision, false, n_threads);
+
+    if(this->_confs_no == 0)
+        return;
+
+    // The last configuration only gets the part of its probability up to _precision, as in IsoStochasticGenerator
+    double prob_so_far = 0.0;
+    for(size_t ii = 0; ii < this->_confs_no - 1; ii++)
+        prob_so_far += this->_probs[ii];
+    if(prob_so_far + this->_probs[this->_confs_no - 1] > _precision)
+        this->_probs[this->_confs_no - 1] = (std::max)(_precision - prob_so_far, 0.0);
+
+    const size_t no_chunks = (this->_confs_no + ISOSPEC_STOCHASTIC_CHUNK_SIZE - 1) / ISOSPEC_STOCHASTIC_CHUNK_SIZE;
+    auto chunk_start = [&](size_t chunk_idx) { return (std::min)(chunk_idx * ISOSPEC_STOCHASTIC_CHUNK_SIZE, this->_confs_no); };
+
+    std::unique_ptr<double[]> chunk_probs(new double[no_chunks]);
+    parallel_for(no_chunks, n_threads, [&](size_t chunk_idx, unsigned int)
+    {
+        double chunk_prob = 0.0;
+        for(size_t ii = chunk_start(chunk_idx); ii < chunk_start(chunk_idx+1); ii++)
+            chunk_prob += this->_probs[ii];
+        chunk_probs[chunk_idx] = chunk_prob;
+    });
+
+    // Split the molecules among the chunks...
+    std::unique_ptr<size_t[]> chunk_molecules(new size_t[no_chunks]);
+    {
+        double prob_left = 0.0;
+        for(size_t ii = 0; ii < no_chunks; ii++)
+            prob_left += chunk_probs[ii];
+
+        std::mt19937 rgen = seeded_stream(seed, {});
+        size_t left = _no_molecules;
+        for(size_t ii = 0; ii < no_chunks; ii++)
+        {
+            if(ii + 1 == no_chunks || chunk_probs[ii] >= prob_left)
+                chunk_molecules[ii] = left;
+            else
+                chunk_molecules[ii] = rdvariate_binom(left, chunk_probs[ii] / prob_left, rgen);
+            left -= chunk_molecules[ii];
+            prob_left -= chunk_probs[ii];
+        }
+    }
+
+    // ...sample each one, and squeeze the configurations which got any to its beginning...
+    std::unique_ptr<size_t[]> chunk_sizes(new size_t[no_chunks]);
+    parallel_for(no_chunks, n_threads, [&](size_t chunk_idx, unsigned int)
+    {
+        const size_t start = chunk_start(chunk_idx);
+        const size_t end = chunk_start(chunk_idx+1);
+        std::mt19937 rgen = seeded_stream(seed, {static_cast<uint32_t>(chunk_idx), static_cast<uint32_t>(static_cast<uint64_t>(chunk_idx) >> 32)});
+
+        sample_counts(this->_probs + start, end - start, chunk_probs[chunk_idx], chunk_molecules[chunk_idx], _beta_bias, rgen);
+
+        size_t out = start;
+        for(size_t ii = start; ii < end; ii++)
+            if(this->_probs[ii] > 0.0)
+            {
+                this->_probs[out] = this->_probs[ii];
+                this->_masses[out] = this->_masses[ii];
+                constexpr_if(tgetConfs)
+                    memmove(this->_confs + out * this->allDim, this->_confs + ii * this->allDim, this->allDimSizeofInt);
+                out++;
+            }
+        chunk_sizes[chunk_idx] = out - start;
+    });
+
+    // ...and then close the gaps between the chunks.
+    size_t out = chunk_sizes[0];
+    for(size_t chunk_idx = 1; chunk_idx < no_chunks; chunk_idx++)
+    {
+        const size_t start = chunk_start(chunk_idx);
+        const size_t len = chunk_sizes[chunk_idx];
+        memmove(this->_probs + out, this->_probs + start, len * sizeof(double));
+        memmove(this->_masses + out, this->_masses + start, len * sizeof(double));
+        constexpr_if(tgetConfs)
+            memmove(this->_confs + out * this->allDim, this->_confs + start * this->allDim, len * this->allDimSizeofInt);
+        out += len;
+    }
+
+    this->_confs_no = out;
+
+    if(this->_confs_no > 0 && this->_confs_no <= this->current_size/2)
+        this->template reallocate_memory<tgetConfs>(this->_confs_no);
+}
+
+template void FixedEnvelope::seeded_stochastic_init<true>(Iso&& iso, size_t _no_molecules, uint64_t seed, double _precision, double _beta_bias, unsigned int n_threads);
+template void FixedEnvelope::seeded_stochastic_init<false>(Iso&& iso, size_t _no_molecules, uint64_t seed, double _precision, double _beta_bias, unsigned int n_threads);
+
 double FixedEnvelope::empiric_average_mass()
 {
     double ret = 0.0;
@@ -1087,90 +2075,25 @@ double FixedEnvelope::empiric_variance()
 
 FixedEnvelope FixedEnvelope::Binned(Iso&& iso, double target_total_prob, double bin_width, double bin_middle)
 {
-    FixedEnvelope ret;
-
-    double min_mass = iso.getLightestPeakMass();
-    double range_len = iso.getHeaviestPeakMass() - min_mass;
-    size_t no_bins = static_cast<size_t>(range_len / bin_width) + 2;
-    double half_width = 0.5*bin_width;
-    double hwmm = half_width-bin_middle;
-    size_t idx_min = floor((min_mass + hwmm) / bin_width);
-    size_t idx_max = idx_min + no_bins;
-
-    double* acc;
-# if ISOSPEC_GOT_MMAN
-    acc = reinterpret_cast<double*>(mmap(nullptr, sizeof(double)*no_bins, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
-#else
-    // This will probably crash for large molecules and high resolutions...
-    acc = reinterpret_cast<double*>(calloc(no_bins, sizeof(double)));
-#endif
-    if(acc == NULL)
-        throw std::bad_alloc();
-
-    acc -= idx_min;
+    const double min_mass = iso.getLightestPeakMass();
+    const double max_mass = iso.getHeaviestPeakMass();
 
     IsoLayeredGenerator ITG(std::move(iso));
 
-
-    bool non_empty;
-    while((non_empty = ITG.advanceToNextConfiguration()) && ITG.prob() == 0.0)
-    {}
-
-    if(non_empty)
+    auto walk = [&](auto&& emit)
     {
-        double accum_prob = ITG.prob();
-        size_t nonzero_idx = floor((ITG.mass() + hwmm)/bin_width);
-        acc[nonzero_idx] = accum_prob;
-
-        while(ITG.advanceToNextConfiguration() && accum_prob < target_total_prob)
+        double accum_prob = 0.0;
+        while(ITG.advanceToNextConfiguration())
         {
-            double prob = ITG.prob();
+            const double prob = ITG.prob();
+            emit(ITG.mass(), prob);
             accum_prob += prob;
-            size_t bin_idx = floor((ITG.mass() + hwmm)/bin_width);
-            acc[bin_idx] += prob;
-        }
-
-        // Making the assumption that there won't be gaps of more than 10 Da in the spectrum. This is true for all
-        // molecules made of natural elements.
-        size_t distance_10da = static_cast<size_t>(10.0/bin_width) + 1;
-
-        size_t empty_steps = 0;
-
-        ret.reallocate_memory<false>(ISOSPEC_INIT_TABLE_SIZE);
-
-        for(size_t ii = nonzero_idx; ii >= idx_min && empty_steps < distance_10da; ii--)
-        {
-            if(acc[ii] > 0.0)
-            {
-                empty_steps = 0;
-                ret.store_conf(static_cast<double>(ii)*bin_width + bin_middle, acc[ii]);
-            }
-            else
-                empty_steps++;
-        }
-
-        empty_steps = 0;
-        for(size_t ii = nonzero_idx+1; ii < idx_max && empty_steps < distance_10da; ii++)
-        {
-            if(acc[ii] > 0.0)
-            {
-                empty_steps = 0;
-                ret.store_conf(static_cast<double>(ii)*bin_width + bin_middle, acc[ii]);
-            }
-            else
-                empty_steps++;
+            if(accum_prob >= target_total_prob)
+                break;
         }
-    }
-
-    acc += idx_min;
+    };
 
-# if ISOSPEC_GOT_MMAN
-    munmap(acc, sizeof(double)*no_bins);
-#else
-    free(acc);
-#endif
-
-    return ret;
+    return collect_peaks(walk, bin_width, bin_middle, min_mass, max_mass);
 }
 
 }  // namespace IsoSpec
@@ -17,6 +17,7 @@
 #pragma once
 
 #include <cstdlib>
+#include <cstdint>
 #include <algorithm>
 #include <vector>
 #include <utility>
@@ -29,14 +30,119 @@
 #define ISOSPEC_INIT_TABLE_SIZE 1024
 #endif
 
+// How many work ranges per thread to aim for when splitting a configuration space for parallel enumeration.
+// The ranges differ in size a lot, so we need plenty of them for the dynamic scheduling to balance the load.
+#define ISOSPEC_WORK_RANGES_PER_THREAD 64
+
+// The lowest threshold (relative to the mode, in log space) FromTopK tries before falling back to taking all the
+// configurations. Well above log(DBL_MIN), so that the threshold itself doesn't underflow.
+#define ISOSPEC_TOPK_MIN_LOG_THRESHOLD -700.0
+
+// The number of configurations sampled from a single random stream by FromStochasticSeeded. Fixed, so that the
+// result depends only on the seed and not on the number of threads - but changing it changes the result.
+#define ISOSPEC_STOCHASTIC_CHUNK_SIZE 65536
+
+// The number of mass bins in a page of the accumulator of Binned and the binned convolutions. Pages are allocated only
+// where the peaks fall, so memory grows with the populated parts of the mass range rather than with its length.
+#define ISOSPEC_BIN_PAGE_SIZE 512
+
+// The largest number of such pages that are looked up in a flat table over the mass range. Wider mass ranges (or
+// narrower bins) get a hash map of the pages that are actually hit instead.
+#define ISOSPEC_MAX_DENSE_BIN_PAGES (1 << 20)
+
+// The smallest total number of peaks for which FixedEnvelope::LinearCombination merges sorted spectra on several threads
+#define ISOSPEC_PARALLEL_MERGE_MIN_SIZE (1 << 18)
+
 namespace IsoSpec
 {
 
 class FixedEnvelope;
 
+//! The abyssal Wasserstein distance between an experimental spectrum and a mix of N theoretical ones, and its gradient.
+/*!
+    envelopes[0] is the experimental spectrum and envelopes[1..N] the theoretical ones; all are scaled by the corresponding
+    entries of scales, which, like ret_gradient, has N+1 entries. Probability is transported between the experimental and
+    theoretical signal no further than abyss_depth_exp + abyss_depth_the; what's left costs abyss_depth_exp per unit of
+    experimental, and abyss_depth_the per unit of theoretical signal. With abyss_depth_exp = abyss_depth_the = d/2 this is
+    FixedEnvelope::ScaledAbyssalWassersteinDistance with abyss_depth d.
+
+    On return ret_gradient holds the derivatives of the distance w.r.t. the scales. The distance is piecewise linear in
+    them: on the boundaries of the pieces this is the derivative on one of the sides. The envelopes get sorted by mass.
+*/
 double AbyssalWassersteinDistanceGrad(FixedEnvelope* const* envelopes, const double* scales, double* ret_gradient, size_t N, double abyss_depth_exp, double abyss_depth_the);
 
 
+//! Repeated evaluations of AbyssalWassersteinDistanceGrad for a fixed set of envelopes and varying scales, as in fitting.
+/*!
+    The peaks of all the envelopes are merged by mass once, on construction; each evaluation is then a single linear pass
+    over the merged table, with no sorting or merging. The envelopes themselves aren't modified, nor needed afterwards.
+    The scratch space is kept between the evaluations, so a context can't be used from several threads at once.
+*/
+class ISOSPEC_EXPORT_SYMBOL AbyssalFitContext
+{
+    //! A peak in a chunk of signal carried by the abyssal transport: its contribution to the gradient is coef * (weight - base).
+    struct GradTerm
+    {
+        unsigned int owner;
+        double coef;
+        double base;
+    };
+
+    //! A chunk of signal carried by the abyssal transport: its terms start at start, the sum of the factors applied to it is weight.
+    struct GradChunk
+    {
+        size_t start;
+        double weight;
+    };
+
+    const size_t K;
+    const double abyss_depth_exp;
+    const double abyss_depth_the;
+
+    std::vector<double> masses;
+    std::vector<double> raw_probs;  /*!< Negative for the experimental peaks. */
+    std::vector<unsigned int> owners;
+
+    std::vector<double> scaled_probs;
+    std::vector<std::pair<double, double>> carried;
+    std::vector<GradChunk> carried_chunks;
+    std::vector<GradTerm> terms;
+
+    template<bool track_gradient> double evaluate_impl(const double* scales, double* ret_gradient);
+
+    template<bool track_gradient, typename NextPeak> static double abyssal_transport(size_t K, double abyss_depth_exp, double abyss_depth_the,
+                                                                                     NextPeak&& next_peak, double* ret_gradient,
+                                                                                     std::vector<std::pair<double, double>>& carried,
+                                                                                     std::vector<GradChunk>& carried_chunks,
+                                                                                     std::vector<GradTerm>& terms);
+
+    template<bool track_gradient> static double abyssal_merge(FixedEnvelope* const* envelopes, const double* scales, size_t N,
+                                                              double abyss_depth_exp, double abyss_depth_the, double* ret_gradient);
+
+    // The one-shot distances share the transport, see FixedEnvelope::ScaledAbyssalWassersteinDistance
+    friend class FixedEnvelope;
+    friend double AbyssalWassersteinDistanceGrad(FixedEnvelope* const* envelopes, const double* scales, double* ret_gradient, size_t N, double abyss_depth_exp, double abyss_depth_the);
+
+ public:
+    //! envelopes[0] is the experimental spectrum and envelopes[1..N] the theoretical ones, as in AbyssalWassersteinDistanceGrad.
+    AbyssalFitContext(const FixedEnvelope* const* envelopes, size_t N, double abyss_depth_exp, double abyss_depth_the);
+
+    //! The number of envelopes, and so the length of the scale and gradient vectors: N+1.
+    inline size_t size() const { return K; }
+
+    //! The distance for the given N+1 scales, and, unless ret_gradient is nullptr, its gradient, as AbyssalWassersteinDistanceGrad.
+    double evaluate(const double* scales, double* ret_gradient = nullptr);
+
+    //! Minimize the distance over the nonnegative scales of the theoretical envelopes, starting from (and updating) scales.
+    /*!
+        A projected gradient descent, with the step adapted to the progress: it stops after max_iterations evaluations,
+        or once the step falls below tolerance times the initial one. scales[0], of the experimental spectrum, stays as
+        given. Returns the distance at the final scales.
+    */
+    double fit(double* scales, size_t max_iterations = 1000, double tolerance = 1e-9);
+};
+
+
 class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
  protected:
     double* _masses;
@@ -82,6 +188,28 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
     FixedEnvelope operator+(const FixedEnvelope& other) const;
     FixedEnvelope operator*(const FixedEnvelope& other) const;
 
+    //! The convolution with another envelope (as operator*), leaving out the peaks below a threshold.
+    /*!
+        Both envelopes are walked through in the order of decreasing probability, and each inner loop stops at the
+        first product below the threshold, so that the cost is proportional to the size of the result (plus sorting
+        the inputs), rather than to the size of the full product.
+        \param threshold The lower bound on the probability of the returned peaks.
+        \param absolute If false, the threshold is relative to the highest peak of the full product.
+        \param bin_width If positive, the peaks are summed up into mass bins, as by bin(), as they're computed.
+        \param bin_middle The bin offset, see bin().
+    */
+    FixedEnvelope convolve(const FixedEnvelope& other, double threshold, bool absolute = true, double bin_width = 0.0, double bin_middle = 0.0) const;
+
+    //! The smallest set of the most probable peaks of the convolution with another envelope, covering a fraction of its total probability.
+    /*!
+        The peaks of the product are generated in the order of decreasing probability, each one only once the previous
+        ones have been, and the generation stops as soon as the target is reached.
+        \param target_total_prob The fraction of the total probability of the full product to cover, in [0, 1].
+        \param bin_width If positive, the peaks are summed up into mass bins, as by bin(), as they're computed.
+        \param bin_middle The bin offset, see bin().
+    */
+    FixedEnvelope convolve_total_prob(const FixedEnvelope& other, double target_total_prob, double bin_width = 0.0, double bin_middle = 0.0) const;
+
     inline size_t    confs_no()  const { return _confs_no; }
     inline int       getAllDim() const { return allDim; }
 
@@ -99,8 +227,15 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
     inline double     prob(size_t i)  const { return _probs[i];  }
     inline const int* conf(size_t i)  const { return _confs + i*allDim; }
 
-    void sort_by_mass();
-    void sort_by_prob();
+    //! Sort the peaks (and their configurations) by increasing mass, stably, using up to n_threads threads (0: all the cores).
+    void sort_by_mass(unsigned int n_threads = 1);
+    //! Sort the peaks (and their configurations) by increasing probability, stably, using up to n_threads threads (0: all the cores).
+    void sort_by_prob(unsigned int n_threads = 1);
+
+    //! The positions of the peaks in the order of increasing mass (ties in the current order), without moving anything.
+    std::vector<size_t> get_mass_order(unsigned int n_threads = 1) const;
+    //! The positions of the peaks in the order of increasing probability (ties in the current order), without moving anything.
+    std::vector<size_t> get_prob_order(unsigned int n_threads = 1) const;
 
     double get_total_prob();
     void scale(double factor);
@@ -115,17 +250,53 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
     double WassersteinDistance(FixedEnvelope& other);
     double OrientedWassersteinDistance(FixedEnvelope& other);
     double AbyssalWassersteinDistance(FixedEnvelope& other, double abyss_depth, double other_scale = 1.0);
+
+    //! The AbyssalWassersteinDistance from this envelope to the sum of others[ii] * other_scales[ii], for ii < N.
+    /*!
+        The envelopes are merged on the fly, without building their LinearCombination. All of them get sorted by mass.
+    */
+    double ScaledAbyssalWassersteinDistance(FixedEnvelope* const* others, double abyss_depth, const double* other_scales, size_t N);
     std::tuple<double, double, double> WassersteinMatch(FixedEnvelope& other, double flow_distance, double other_scale = 1.0);
 
+    //! Compute the WassersteinDistance() from this envelope to each of N candidates at once, storing them in ret.
+    /*!
+        Neither this envelope nor the candidates are modified: the ones not sorted by mass are sorted into scratch space,
+        the query only once. The candidates are split between n_threads threads.
+
+        \param best_k If nonzero, only the best_k smallest distances are needed exactly: the computation for a candidate
+        is abandoned, and its distance reported as +inf, as soon as it's known to be larger than the best_k-th one.
+    */
+    void WassersteinDistances(const FixedEnvelope* const* candidates, size_t N, double* ret, size_t best_k = 0, unsigned int n_threads = 1) const;
+
+    //! Compute the AbyssalWassersteinDistance() from this envelope to each of N candidates at once, as WassersteinDistances().
+    void AbyssalWassersteinDistances(const FixedEnvelope* const* candidates, size_t N, double* ret, double abyss_depth, double other_scale = 1.0,
+                                     size_t best_k = 0, unsigned int n_threads = 1) const;
+
 
-    static FixedEnvelope LinearCombination(const std::vector<const FixedEnvelope*>& spectra, const std::vector<double>& intensities);
-    static FixedEnvelope LinearCombination(const FixedEnvelope* const * spectra, const double* intensities, size_t size);
+    //! The sum of the spectra, each multiplied by its intensity.
+    /*!
+        If all the spectra are sorted by mass, they're merged with a loser tree, and so is the result, keeping the merge
+        stable: peaks of equal masses come in the order of their spectra. Large merges are split into disjoint mass ranges,
+        merged on up to n_threads threads. Otherwise the spectra are just concatenated.
+
+        \param merge_epsilon If nonnegative, each group of consecutive peaks of the result within merge_epsilon of the
+        first one of the group is collapsed into a single peak, at the probability-weighted average mass - in particular,
+        0.0 sums up the peaks of exactly equal masses. The result is then sorted by mass even if the spectra weren't.
+    */
+    static FixedEnvelope LinearCombination(const std::vector<const FixedEnvelope*>& spectra, const std::vector<double>& intensities,
+                                           double merge_epsilon = -1.0, unsigned int n_threads = 1);
+    static FixedEnvelope LinearCombination(const FixedEnvelope* const * spectra, const double* intensities, size_t size,
+                                           double merge_epsilon = -1.0, unsigned int n_threads = 1);
 
 
     FixedEnvelope bin(double bin_width = 1.0, double middle = 0.0);
 
  private:
-    void sort_by(double* order);
+    void sort_by(double* keys, unsigned int n_threads);
+    template<typename Kernel> void batch_distances(const FixedEnvelope* const* candidates, size_t N, double* ret, size_t best_k, unsigned int n_threads, Kernel&& kernel) const;
+
+    //! Collect the peaks passed by walk(emit) to emit(mass, prob), binned if bin_width is positive.
+    template<typename Walk> static FixedEnvelope collect_peaks(Walk&& walk, double bin_width, double bin_middle, double min_mass, double max_mass);
 
 
  protected:
@@ -136,6 +307,26 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
         constexpr_if(tgetConfs) { generator.get_conf_signature(tconfs); tconfs += allDim; }
     }
 
+    //! Write all the remaining configurations of the generator at the given (preallocated) locations, one run at a time.
+    template<typename T, bool tgetConfs> ISOSPEC_FORCE_INLINE void store_runs(T& generator, double* ttmasses, double* ttprobs, ISOSPEC_MAYBE_UNUSED int* ttconfs)
+    {
+        while(generator.advanceToNextRun())
+        {
+            const double base_mass = generator.run_base_mass();
+            const double base_prob = generator.run_base_prob();
+            const double* run_masses = generator.run_masses();
+            const double* run_probs = generator.run_probs();
+            const unsigned int run_end = generator.run_end();
+
+            for(unsigned int ii = generator.run_begin(); ii < run_end; ii++)
+            {
+                *ttmasses = base_mass + run_masses[ii]; ttmasses++;
+                *ttprobs = base_prob * run_probs[ii]; ttprobs++;
+                constexpr_if(tgetConfs) { generator.get_run_conf_signature(ii, ttconfs); ttconfs += allDim; }
+            }
+        }
+    }
+
     ISOSPEC_FORCE_INLINE void store_conf(double _mass, double _prob)
     {
         if(_confs_no == current_size)
@@ -166,8 +357,16 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
     template<bool tgetConfs> void reallocate_memory(size_t new_size);
     void slow_reallocate_memory(size_t new_size);
 
+    /*! Partition the configurations in [start, end) around a random pivot, moving the more probable ones to the front.
+        The probabilities of the configurations moved in front of the pivot are added to csum.
+        \return The final position of the pivot. */
+    template<bool tgetConfs> size_t partition_by_prob(size_t start, size_t end, int* conf_swapspace, double& csum);
+
+    template<bool tgetConfs> void parallel_threshold_fill(IsoThresholdGenerator& generator, unsigned int n_threads);
+    template<bool tgetConfs> void parallel_layer_fill(IsoLayeredGenerator& generator, unsigned int n_threads);
+
  public:
-    template<bool tgetConfs> void threshold_init(Iso&& iso, double threshold, bool absolute);
+    template<bool tgetConfs> void threshold_init(Iso&& iso, double threshold, bool absolute, unsigned int n_threads = 1);
 
     template<bool tgetConfs, typename GenType = IsoLayeredGenerator> void addConfILG(const GenType& generator)
     {
@@ -178,39 +377,88 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
         this->_confs_no++;
     }
 
-    template<bool tgetConfs> void total_prob_init(Iso&& iso, double target_prob, bool trim);
+    template<bool tgetConfs> void total_prob_init(Iso&& iso, double target_prob, bool trim, unsigned int n_threads = 1);
 
-    static FixedEnvelope FromThreshold(Iso&& iso, double threshold, bool absolute, bool tgetConfs = false)
+    /*! Compute all the isotopologues above the threshold. With n_threads other than 1 the configuration space is split into
+        work ranges enumerated by n_threads threads (0 meaning as many as there are cores). The result, including the
+        order of configurations, is the same as in the single-threaded case. */
+    static FixedEnvelope FromThreshold(Iso&& iso, double threshold, bool absolute, bool tgetConfs = false, unsigned int n_threads = 1)
     {
         FixedEnvelope ret;
 
         if(tgetConfs)
-            ret.threshold_init<true>(std::move(iso), threshold, absolute);
+            ret.threshold_init<true>(std::move(iso), threshold, absolute, n_threads);
         else
-            ret.threshold_init<false>(std::move(iso), threshold, absolute);
+            ret.threshold_init<false>(std::move(iso), threshold, absolute, n_threads);
         return ret;
     }
 
-    inline static FixedEnvelope FromThreshold(const Iso& iso, double _threshold, bool _absolute, bool tgetConfs = false)
+    inline static FixedEnvelope FromThreshold(const Iso& iso, double _threshold, bool _absolute, bool tgetConfs = false, unsigned int n_threads = 1)
     {
-        return FromThreshold(Iso(iso, false), _threshold, _absolute, tgetConfs);
+        return FromThreshold(Iso(iso, false), _threshold, _absolute, tgetConfs, n_threads);
     }
 
-    static FixedEnvelope FromTotalProb(Iso&& iso, double target_total_prob, bool optimize, bool tgetConfs = false)
+    /*! Compute the smallest set of isotopologues whose probabilities add up to at least target_total_prob (or just some such
+        set, if not optimizing). With n_threads other than 1 each layer of the configuration space is split into work ranges
+        enumerated by n_threads threads (0 meaning as many as there are cores), giving the same result as the single-threaded case. */
+    static FixedEnvelope FromTotalProb(Iso&& iso, double target_total_prob, bool optimize, bool tgetConfs = false, unsigned int n_threads = 1)
     {
         FixedEnvelope ret;
 
         if(tgetConfs)
-            ret.total_prob_init<true>(std::move(iso), target_total_prob, optimize);
+            ret.total_prob_init<true>(std::move(iso), target_total_prob, optimize, n_threads);
         else
-            ret.total_prob_init<false>(std::move(iso), target_total_prob, optimize);
+            ret.total_prob_init<false>(std::move(iso), target_total_prob, optimize, n_threads);
 
         return ret;
     }
 
-    inline static FixedEnvelope FromTotalProb(const Iso& iso, double _target_total_prob, bool _optimize, bool tgetConfs = false)
+    inline static FixedEnvelope FromTotalProb(const Iso& iso, double _target_total_prob, bool _optimize, bool tgetConfs = false, unsigned int n_threads = 1)
     {
-        return FromTotalProb(Iso(iso, false), _target_total_prob, _optimize, tgetConfs);
+        return FromTotalProb(Iso(iso, false), _target_total_prob, _optimize, tgetConfs, n_threads);
+    }
+
+    template<bool tgetConfs> void window_init(Iso&& iso, double mmin, double mmax, double threshold, bool absolute);
+
+    //! Compute the isotopologues above the threshold whose masses fall within [mmin, mmax], see IsoWindowGenerator.
+    inline static FixedEnvelope FromWindow(Iso&& iso, double mmin, double mmax, double threshold, bool absolute, bool tgetConfs = false)
+    {
+        FixedEnvelope ret;
+
+        if(tgetConfs)
+            ret.window_init<true>(std::move(iso), mmin, mmax, threshold, absolute);
+        else
+            ret.window_init<false>(std::move(iso), mmin, mmax, threshold, absolute);
+
+        return ret;
+    }
+
+    inline static FixedEnvelope FromWindow(const Iso& iso, double mmin, double mmax, double threshold, bool absolute, bool tgetConfs = false)
+    {
+        return FromWindow(Iso(iso, false), mmin, mmax, threshold, absolute, tgetConfs);
+    }
+
+    template<bool tgetConfs> void topk_init(Iso&& iso, size_t K);
+
+    /*! Compute the K most probable isotopologues (or all of them, if there are fewer), in no particular order. Of the
+        isotopologues tied with the K-th most probable one, an arbitrary subset is taken. This finds a threshold with
+        a little more than K isotopologues above it by bisection, counting the isotopologues as IsoThresholdGenerator
+        does, and then selects K out of these, so it needs far less time and memory than IsoOrderedGenerator for large K. */
+    inline static FixedEnvelope FromTopK(Iso&& iso, size_t K, bool tgetConfs = false)
+    {
+        FixedEnvelope ret;
+
+        if(tgetConfs)
+            ret.topk_init<true>(std::move(iso), K);
+        else
+            ret.topk_init<false>(std::move(iso), K);
+
+        return ret;
+    }
+
+    inline static FixedEnvelope FromTopK(const Iso& iso, size_t K, bool tgetConfs = false)
+    {
+        return FromTopK(Iso(iso, false), K, tgetConfs);
     }
 
     template<bool tgetConfs> void stochastic_init(Iso&& iso, size_t _no_molecules, double _precision, double _beta_bias);
@@ -232,13 +480,40 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
         return FromStochastic(Iso(iso, false), _no_molecules, _precision, _beta_bias, tgetConfs);
     }
 
+    template<bool tgetConfs> void seeded_stochastic_init(Iso&& iso, size_t _no_molecules, uint64_t seed, double _precision, double _beta_bias, unsigned int n_threads);
+
+    /*! Like FromStochastic, but reproducible: the result depends only on the seed, and not on the number of threads used
+        (0 meaning as many as there are cores). The configurations covering _precision of the probability are computed
+        first (in parallel, as in FromTotalProb), split into fixed chunks, and the molecules are distributed among the
+        chunks multinomially; then each chunk is sampled from its own random stream, derived from the seed and its position.
+        Unlike FromStochastic, this needs memory for all these configurations, not just the sampled ones. */
+    inline static FixedEnvelope FromStochasticSeeded(Iso&& iso, size_t _no_molecules, uint64_t seed, double _precision = 0.9999, double _beta_bias = 5.0, bool tgetConfs = false, unsigned int n_threads = 1)
+    {
+        FixedEnvelope ret;
+
+        if(tgetConfs)
+            ret.seeded_stochastic_init<true>(std::move(iso), _no_molecules, seed, _precision, _beta_bias, n_threads);
+        else
+            ret.seeded_stochastic_init<false>(std::move(iso), _no_molecules, seed, _precision, _beta_bias, n_threads);
+
+        return ret;
+    }
+
+    static FixedEnvelope FromStochasticSeeded(const Iso& iso, size_t _no_molecules, uint64_t seed, double _precision = 0.9999, double _beta_bias = 5.0, bool tgetConfs = false, unsigned int n_threads = 1)
+    {
+        return FromStochasticSeeded(Iso(iso, false), _no_molecules, seed, _precision, _beta_bias, tgetConfs, n_threads);
+    }
+
+    //! The peaks of iso, generated layer by layer until target_total_prob is reached, summed up in bins as by bin().
+    /*!
+        The bins are accumulated in pages allocated only where the peaks fall, so fine bins over the wide mass range
+        of a large molecule cost memory only for the populated regions. The result is sorted by mass.
+    */
     static FixedEnvelope Binned(Iso&& iso, double target_total_prob, double bin_width, double bin_middle = 0.0);
     static FixedEnvelope Binned(const Iso& iso, double target_total_prob, double bin_width, double bin_middle = 0.0)
     {
         return Binned(Iso(iso, false), target_total_prob, bin_width, bin_middle);
     }
-
-    friend double AbyssalWassersteinDistanceGrad(FixedEnvelope* const* envelopes, const double* scales, double* ret_gradient, size_t N, double abyss_depth_exp, double abyss_depth_the);
 };
 
 }  // namespace IsoSpec
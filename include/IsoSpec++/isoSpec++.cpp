@@ -32,9 +32,9 @@
 #include <memory>
 #include <cassert>
 #include <cctype>
+#include <cstdint>
 #include "platform.h"
 #include "conf.h"
-#include "dirtyAllocator.h"
 #include "operators.h"
 #include "summator.h"
 #include "marginalTrek++.h"
@@ -475,9 +475,35 @@ IsoGenerator::~IsoGenerator()
 
 static const double minsqrt = -1.3407796239501852e+154;  // == constexpr(-sqrt(std::numeric_limits<double>::max()));
 
-IsoThresholdGenerator::IsoThresholdGenerator(Iso&& iso, double _threshold, bool _absolute, int tabSize, int hashSize, bool reorder_marginals)
+// Construct a precalculated marginal, or take it from the MarginalCache. The cached ones are kept alive by the
+// references in cached, and must not be deleted along with the others: a generator takes either all or none
+// of its marginals from the cache.
+static PrecalculatedMarginal* precalculate_marginal(Marginal&& m, double lCutOff, bool sort, int tabSize, int hashSize, bool lprobs_only,
+                                                    bool use_cache, std::vector<std::shared_ptr<PrecalculatedMarginal> >& cached)
+{
+    if(!use_cache)
+        return new PrecalculatedMarginal(std::move(m), lCutOff, sort, tabSize, hashSize, lprobs_only);
+
+    cached.push_back(MarginalCache::global().get(std::move(m), lCutOff, sort, tabSize, hashSize, lprobs_only));
+    return cached.back().get();
+}
+
+// Free the marginals of a generator, except for the ones owned by the MarginalCache
+template<typename MarginalType> static void dealloc_marginals(MarginalType** marginals, int dimNumber, bool cached)
+{
+    if(cached)
+        delete[] marginals;
+    else
+        dealloc_table(marginals, dimNumber);
+}
+
+IsoThresholdGenerator::IsoThresholdGenerator(Iso&& iso, double _threshold, bool _absolute, int tabSize, int hashSize, bool reorder_marginals,
+                                             bool _lprobs_only)
 : IsoGenerator(std::move(iso)),
-Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_threshold) + mode_lprob))
+Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_threshold) + mode_lprob)),
+carry_limit(dimNumber-1),
+owns_marginals(true),
+lprobs_only(_lprobs_only)
 {
     counter = new int[dimNumber];
     maxConfsLPSum = new double[dimNumber-1];
@@ -486,15 +512,22 @@ Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_thresh
     empty = false;
 
     const bool marginalsNeedSorting = doMarginalsNeedSorting();
+    const bool use_cache = MarginalCache::global().enabled();
+
+    if(lprobs_only)
+        untrack_masses_and_probs();
 
     for(int ii = 0; ii < dimNumber; ii++)
     {
         counter[ii] = 0;
-        marginalResultsUnsorted[ii] = new PrecalculatedMarginal(std::move(*(marginals[ii])),
+        marginalResultsUnsorted[ii] = precalculate_marginal(std::move(*(marginals[ii])),
                                                         Lcutoff - mode_lprob + marginals[ii]->fastGetModeLProb(),
                                                         marginalsNeedSorting,
                                                         tabSize,
-                                                        hashSize);
+                                                        hashSize,
+                                                        lprobs_only,
+                                                        use_cache,
+                                                        cachedMarginals);
 
         if(!marginalResultsUnsorted[ii]->inRange(0))
             empty = true;
@@ -527,6 +560,7 @@ Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_thresh
     }
 
     lProbs_ptr_start = marginalResults[0]->get_lProbs_ptr();
+    run_start = lProbs_ptr_start;
 
     if(dimNumber > 1)
         maxConfsLPSum[0] = marginalResults[0]->fastGetModeLProb();
@@ -552,18 +586,48 @@ Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_thresh
     }
 }
 
+IsoThresholdGenerator::IsoThresholdGenerator(const IsoThresholdGenerator& other, int split_dim, const int* range)
+: IsoGenerator(Iso(other, false)),
+counter(new int[dimNumber]),
+maxConfsLPSum(array_copy<double>(other.maxConfsLPSum, dimNumber-1)),
+Lcutoff(other.Lcutoff),
+marginalResults(other.marginalResults),
+marginalResultsUnsorted(other.marginalResultsUnsorted),
+marginalOrder(other.marginalOrder),
+lProbs_ptr_start(other.lProbs_ptr_start),
+run_start(other.lProbs_ptr_start),
+partialLProbs_second(partialLProbs+1),
+empty(other.empty),
+carry_limit(dimNumber-1),
+owns_marginals(false),
+lprobs_only(other.lprobs_only)
+{
+    if(lprobs_only)
+        untrack_masses_and_probs();
+    restrict_to_range(split_dim, range);
+}
+
+void IsoThresholdGenerator::untrack_masses_and_probs()
+{
+    // Not updated in the lprobs_only mode: NaNs make sure that mass() and prob() don't return anything plausible
+    std::fill(partialMasses, partialMasses + dimNumber, std::numeric_limits<double>::quiet_NaN());
+    std::fill(partialProbs, partialProbs + dimNumber, std::numeric_limits<double>::quiet_NaN());
+}
+
 void IsoThresholdGenerator::terminate_search()
 {
-    for(int ii = 0; ii < dimNumber; ii++)
+    // Counters of marginals fixed by a work range are left alone, so that reset() can still rewind to its beginning
+    for(int ii = 0; ii <= carry_limit; ii++)
     {
         counter[ii] = marginalResults[ii]->get_no_confs()-1;
         partialLProbs[ii] = -std::numeric_limits<double>::infinity();
     }
-    partialLProbs[dimNumber] = -std::numeric_limits<double>::infinity();
+    if(carry_limit == dimNumber-1)
+        partialLProbs[dimNumber] = -std::numeric_limits<double>::infinity();
     lProbs_ptr = lProbs_ptr_start + marginalResults[0]->get_no_confs()-1;
 }
 
-size_t IsoThresholdGenerator::count_confs()
+size_t IsoThresholdGenerator::count_confs(size_t max_count)
 {
     if(empty)
         return 0;
@@ -580,17 +644,25 @@ size_t IsoThresholdGenerator::count_confs()
 
     size_t count = 0;
 
-    while(*lProbs_ptr_l < lcfmsv)
-        lProbs_ptr_l--;
+    // Within a run only marginal 0 changes, and its lProbs are sorted, so the end of the run can be binary-searched
+    // for instead of walking through it. The restart positions bound the search from above: the run of marginal 0
+    // can only get shorter as the counter of any other marginal goes up.
+    lProbs_ptr_l = last_not_below(lProbs_ptr_start, lProbs_ptr_l + 1, lcfmsv);
 
     while(true)
     {
         count += lProbs_ptr_l - lProbs_ptr_start + 1;
 
+        if(count > max_count)
+        {
+            reset();
+            return count;
+        }
+
         int idx = 0;
         int * cntr_ptr = counter;
 
-        while(idx < dimNumber - 1)
+        while(idx < carry_limit)
         {
             *cntr_ptr = 0;
             idx++;
@@ -601,15 +673,13 @@ size_t IsoThresholdGenerator::count_confs()
             if(partialLProbs[idx] + maxConfsLPSum[idx-1] >= Lcutoff)
             {
                 short_recalc(idx-1);
-                lProbs_ptr_l = lProbs_restarts[idx];
-                while(*lProbs_ptr_l < lcfmsv)
-                    lProbs_ptr_l--;
+                lProbs_ptr_l = last_not_below(lProbs_ptr_start, lProbs_restarts[idx] + 1, lcfmsv);
                 for(idx--; idx > 0; idx--)
                     lProbs_restarts[idx] = lProbs_ptr_l;
                 break;
             }
         }
-        if(idx == dimNumber - 1)
+        if(idx == carry_limit)
         {
             reset();
             return count;
@@ -617,6 +687,93 @@ size_t IsoThresholdGenerator::count_confs()
     }
 }
 
+// Call f on each setting of the counters of the outer marginals for which some configuration is above the cutoff,
+// in the order in which a generator visits them. outerMaxConfsLPSum[ii] is the sum of the mode log-probabilities
+// of all the marginals preceding outer[ii].
+template<typename MarginalType, typename F> static void walk_outer_counters(MarginalType* const * outer, const double* outerMaxConfsLPSum, int width, double cutoff, F&& f)
+{
+    std::unique_ptr<int[]> cntr(new int[width]);
+    std::unique_ptr<double[]> partials(new double[width+1]);
+
+    memset(cntr.get(), 0, sizeof(int)*width);
+    partials[width] = 0.0;
+    for(int ii = width-1; ii >= 0; ii--)
+        partials[ii] = partials[ii+1] + outer[ii]->get_lProb(0);
+
+    // All outer counters at 0 correspond to the mode, which is never below the cutoff
+    while(true)
+    {
+        f(static_cast<const int*>(cntr.get()));
+
+        int idx = 0;
+        while(idx < width)
+        {
+            cntr[idx]++;
+            partials[idx] = partials[idx+1] + outer[idx]->get_lProb(cntr[idx]);
+            if(partials[idx] + outerMaxConfsLPSum[idx] >= cutoff)
+                break;
+            cntr[idx] = 0;
+            idx++;
+        }
+
+        if(idx == width)
+            return;
+
+        for(idx--; idx >= 0; idx--)
+            partials[idx] = partials[idx+1] + outer[idx]->get_lProb(0);
+    }
+}
+
+// The work ranges of a generator with dimNumber marginals, see IsoThresholdGenerator::get_work_ranges(). walk_ranges(split_dim, f)
+// is its walk_work_ranges(), the only part that differs between the generators that can be split.
+template<typename WalkRanges> static std::vector<int> collect_work_ranges(WalkRanges&& walk_ranges, int dimNumber, int split_dim)
+{
+    std::vector<int> ret;
+    const int width = dimNumber - split_dim;
+    walk_ranges(split_dim, [&](const int* range) { ret.insert(ret.end(), range, range + width); });
+    return ret;
+}
+
+// Pick the split_dim of a generator, see IsoThresholdGenerator::choose_split_dim() and collect_work_ranges().
+template<typename WalkRanges> static int choose_split_dim_by(WalkRanges&& walk_ranges, int dimNumber, size_t min_ranges)
+{
+    int split_dim = dimNumber-1;
+    while(split_dim > 1)
+    {
+        size_t no_ranges = 0;
+        walk_ranges(split_dim, [&](const int*) { no_ranges++; });
+        if(no_ranges >= min_ranges)
+            break;
+        split_dim--;
+    }
+    return split_dim;
+}
+
+template<typename F> void IsoThresholdGenerator::walk_work_ranges(int split_dim, F&& f) const
+{
+    if(empty)
+        return;
+
+    walk_outer_counters(marginalResults + split_dim, maxConfsLPSum + split_dim - 1, dimNumber - split_dim, Lcutoff, std::forward<F>(f));
+}
+
+std::vector<int> IsoThresholdGenerator::get_work_ranges(int split_dim) const
+{
+    return collect_work_ranges([this](int sd, auto&& f) { walk_work_ranges(sd, f); }, dimNumber, split_dim);
+}
+
+int IsoThresholdGenerator::choose_split_dim(size_t min_ranges) const
+{
+    return choose_split_dim_by([this](int sd, auto&& f) { walk_work_ranges(sd, f); }, dimNumber, min_ranges);
+}
+
+void IsoThresholdGenerator::restrict_to_range(int split_dim, const int* range)
+{
+    carry_limit = split_dim-1;
+    memcpy(counter + split_dim, range, sizeof(int)*(dimNumber - split_dim));
+    reset();
+}
+
 void IsoThresholdGenerator::reset()
 {
     if(empty)
@@ -627,20 +784,342 @@ void IsoThresholdGenerator::reset()
 
     partialLProbs[dimNumber] = 0.0;
 
-    memset(counter, 0, sizeof(int)*dimNumber);
+    memset(counter, 0, sizeof(int)*(carry_limit+1));
     recalc(dimNumber-1);
     counter[0]--;
 
     lProbs_ptr = lProbs_ptr_start - 1;
 }
 
+// Cursor blobs are laid out as the host stores the values: they are meant for checkpoints, not for exchanging data.
+static const uint32_t threshold_cursor_magic = 0x49535431;  // "IST1"
+static const uint32_t layered_cursor_magic = 0x49534C31;    // "ISL1"
+
+template<typename T> static void cursor_write(std::vector<unsigned char>& blob, const T* values, size_t n = 1)
+{
+    const size_t offset = blob.size();
+    blob.resize(offset + n * sizeof(T));
+    memcpy(blob.data() + offset, values, n * sizeof(T));
+}
+
+template<typename T> static void cursor_read(const unsigned char*& blob, const unsigned char* blob_end, T* values, size_t n = 1)
+{
+    if(static_cast<size_t>(blob_end - blob) / sizeof(T) < n)
+        throw std::invalid_argument("Generator cursor is truncated");
+    memcpy(values, blob, n * sizeof(T));
+    blob += n * sizeof(T);
+}
+
+namespace {
+
+// The part of the cursor common to the threshold and layered generators. The partial sums are saved as they are,
+// rather than recomputed from the counters on restoring: once a carry fails they are no longer consistent with them.
+struct GeneratorCursor
+{
+    int32_t carry_limit;
+    std::vector<int> counter;
+    std::vector<double> partialLProbs, partialMasses, partialProbs;
+    double partialLProbs_second_val, lcfmsv;
+    int64_t lProbs_offset;
+
+    void write(std::vector<unsigned char>& blob, uint32_t magic, int dimNumber) const
+    {
+        cursor_write(blob, &magic);
+        cursor_write(blob, &dimNumber);
+        cursor_write(blob, &carry_limit);
+        cursor_write(blob, counter.data(), dimNumber);
+        cursor_write(blob, partialLProbs.data(), dimNumber+1);
+        cursor_write(blob, partialMasses.data(), dimNumber+1);
+        cursor_write(blob, partialProbs.data(), dimNumber+1);
+        cursor_write(blob, &partialLProbs_second_val);
+        cursor_write(blob, &lcfmsv);
+        cursor_write(blob, &lProbs_offset);
+    }
+
+    void read(const unsigned char*& blob, const unsigned char* blob_end, uint32_t magic, int dimNumber)
+    {
+        uint32_t blob_magic;
+        int32_t blob_dimNumber;
+        cursor_read(blob, blob_end, &blob_magic);
+        if(blob_magic != magic)
+            throw std::invalid_argument("Generator cursor was saved by a different kind of generator");
+        cursor_read(blob, blob_end, &blob_dimNumber);
+        cursor_read(blob, blob_end, &carry_limit);
+        if(blob_dimNumber != dimNumber || carry_limit < 0 || carry_limit >= dimNumber)
+            throw std::invalid_argument("Generator cursor was saved by a generator of a different molecule");
+        counter.resize(dimNumber);
+        partialLProbs.resize(dimNumber+1);
+        partialMasses.resize(dimNumber+1);
+        partialProbs.resize(dimNumber+1);
+        cursor_read(blob, blob_end, counter.data(), dimNumber);
+        cursor_read(blob, blob_end, partialLProbs.data(), dimNumber+1);
+        cursor_read(blob, blob_end, partialMasses.data(), dimNumber+1);
+        cursor_read(blob, blob_end, partialProbs.data(), dimNumber+1);
+        cursor_read(blob, blob_end, &partialLProbs_second_val);
+        cursor_read(blob, blob_end, &lcfmsv);
+        cursor_read(blob, blob_end, &lProbs_offset);
+    }
+
+    // The counters may point one past the last subisotopologue (at the guard) after a carry fails, and the
+    // position within marginal 0 may be one before the first one, before the first configuration.
+    template<typename MarginalType> void check(MarginalType* const * marginals, int dimNumber) const
+    {
+        for(int ii = 0; ii < dimNumber; ii++)
+            if(counter[ii] < -1 || counter[ii] > static_cast<int>(marginals[ii]->get_no_confs()))
+                throw std::invalid_argument("Generator cursor was saved by a generator of a different molecule");
+        if(lProbs_offset < -1 || lProbs_offset > static_cast<int64_t>(marginals[0]->get_no_confs()))
+            throw std::invalid_argument("Generator cursor was saved by a generator of a different molecule");
+    }
+};
+
+}  // namespace
+
+std::vector<unsigned char> IsoThresholdGenerator::save_cursor() const
+{
+    GeneratorCursor cursor;
+    cursor.carry_limit = carry_limit;
+    cursor.counter.assign(counter, counter + dimNumber);
+    cursor.partialLProbs.assign(partialLProbs, partialLProbs + dimNumber + 1);
+    cursor.partialMasses.assign(partialMasses, partialMasses + dimNumber + 1);
+    cursor.partialProbs.assign(partialProbs, partialProbs + dimNumber + 1);
+    cursor.partialLProbs_second_val = partialLProbs_second_val;
+    cursor.lcfmsv = lcfmsv;
+    cursor.lProbs_offset = lProbs_ptr - lProbs_ptr_start;
+
+    std::vector<unsigned char> blob;
+    const uint8_t blob_lprobs_only = lprobs_only ? 1 : 0;
+    cursor.write(blob, threshold_cursor_magic, dimNumber);
+    cursor_write(blob, &Lcutoff);
+    cursor_write(blob, &blob_lprobs_only);
+    return blob;
+}
+
+void IsoThresholdGenerator::restore_cursor(const unsigned char* blob, size_t size)
+{
+    const unsigned char* blob_end = blob + size;
+    GeneratorCursor cursor;
+    double blob_Lcutoff;
+    uint8_t blob_lprobs_only;
+
+    cursor.read(blob, blob_end, threshold_cursor_magic, dimNumber);
+    cursor_read(blob, blob_end, &blob_Lcutoff);
+    cursor_read(blob, blob_end, &blob_lprobs_only);
+
+    if(blob_Lcutoff != Lcutoff)
+        throw std::invalid_argument("Generator cursor was saved by a generator with a different threshold");
+    // The partial masses and probabilities are not tracked in the lprobs_only mode, and hold NaNs
+    if(blob_lprobs_only != (lprobs_only ? 1 : 0))
+        throw std::invalid_argument("Generator cursor was saved by a generator with a different lprobs_only setting");
+    cursor.check(marginalResults, dimNumber);
+
+    carry_limit = cursor.carry_limit;
+    memcpy(counter, cursor.counter.data(), sizeof(int)*dimNumber);
+    memcpy(partialLProbs, cursor.partialLProbs.data(), sizeof(double)*(dimNumber+1));
+    memcpy(partialMasses, cursor.partialMasses.data(), sizeof(double)*(dimNumber+1));
+    memcpy(partialProbs, cursor.partialProbs.data(), sizeof(double)*(dimNumber+1));
+    partialLProbs_second_val = cursor.partialLProbs_second_val;
+    lcfmsv = cursor.lcfmsv;
+    lProbs_ptr = lProbs_ptr_start + cursor.lProbs_offset;
+}
+
 IsoThresholdGenerator::~IsoThresholdGenerator()
 {
     delete[] counter;
     delete[] maxConfsLPSum;
+    if(owns_marginals)
+    {
+        if (marginalResultsUnsorted != marginalResults)
+            delete[] marginalResultsUnsorted;
+        dealloc_marginals(marginalResults, dimNumber, !cachedMarginals.empty());
+        if(marginalOrder != nullptr)
+            delete[] marginalOrder;
+    }
+}
+
+
+/*
+ * ------------------------------------------------------------------------------------------------------------------------
+ */
+
+
+IsoWindowGenerator::IsoWindowGenerator(Iso&& iso, double _mmin, double _mmax, double _threshold, bool _absolute, int tabSize, int hashSize, bool reorder_marginals)
+: IsoGenerator(std::move(iso)),
+Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_threshold) + mode_lprob)),
+mmin(_mmin),
+mmax(_mmax)
+{
+    counter = new int[dimNumber];
+    maxConfsLPSum = new double[dimNumber-1];
+    minMassSum = new double[dimNumber];
+    maxMassSum = new double[dimNumber];
+    marginalResultsUnsorted = new PrecalculatedMarginal*[dimNumber];
+
+    empty = !(mmin <= mmax);
+
+    const bool marginalsNeedSorting = doMarginalsNeedSorting();
+    const bool use_cache = MarginalCache::global().enabled();
+
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        counter[ii] = 0;
+        marginalResultsUnsorted[ii] = precalculate_marginal(std::move(*(marginals[ii])),
+                                                        Lcutoff - mode_lprob + marginals[ii]->fastGetModeLProb(),
+                                                        marginalsNeedSorting,
+                                                        tabSize,
+                                                        hashSize,
+                                                        false,
+                                                        use_cache,
+                                                        cachedMarginals);
+
+        if(!marginalResultsUnsorted[ii]->inRange(0))
+            empty = true;
+    }
+
+    if(reorder_marginals && dimNumber > 1)
+    {
+        OrderMarginalsBySizeDecresing<PrecalculatedMarginal> comparator(marginalResultsUnsorted);
+        int* tmpMarginalOrder = new int[dimNumber];
+
+        for(int ii = 0; ii < dimNumber; ii++)
+            tmpMarginalOrder[ii] = ii;
+
+        std::sort(tmpMarginalOrder, tmpMarginalOrder + dimNumber, comparator);
+        marginalResults = new PrecalculatedMarginal*[dimNumber];
+
+        for(int ii = 0; ii < dimNumber; ii++)
+            marginalResults[ii] = marginalResultsUnsorted[tmpMarginalOrder[ii]];
+
+        marginalOrder = new int[dimNumber];
+        for(int ii = 0; ii < dimNumber; ii++)
+            marginalOrder[tmpMarginalOrder[ii]] = ii;
+
+        delete[] tmpMarginalOrder;
+    }
+    else
+    {
+        marginalResults = marginalResultsUnsorted;
+        marginalOrder = nullptr;
+    }
+
+    lProbs_ptr_start = marginalResults[0]->get_lProbs_ptr();
+    masses_ptr_start = marginalResults[0]->get_masses_ptr();
+
+    if(dimNumber > 1)
+        maxConfsLPSum[0] = marginalResults[0]->fastGetModeLProb();
+
+    for(int ii = 1; ii < dimNumber-1; ii++)
+        maxConfsLPSum[ii] = maxConfsLPSum[ii-1] + marginalResults[ii]->fastGetModeLProb();
+
+    double min_sum = 0.0;
+    double max_sum = 0.0;
+    for(int ii = 0; ii < dimNumber && !empty; ii++)
+    {
+        const double* masses = marginalResults[ii]->get_masses_ptr();
+        const auto minmax = std::minmax_element(masses, masses + marginalResults[ii]->get_no_confs());
+        min_sum += *minmax.first;
+        max_sum += *minmax.second;
+        minMassSum[ii] = min_sum;
+        maxMassSum[ii] = max_sum;
+    }
+
+    // The bounds are summed up in a different order than the masses of the configurations, so the subtrees are pruned
+    // with a margin for the rounding errors. The configurations themselves are checked against the exact window.
+    const double slack = (fabs(mmin) + fabs(mmax) + max_sum) * (dimNumber + 1) * std::numeric_limits<double>::epsilon();
+    prune_mmin = mmin - slack;
+    prune_mmax = mmax + slack;
+
+    partialLProbs_second = partialLProbs;
+    partialLProbs_second++;
+
+    reset();
+}
+
+bool IsoWindowGenerator::descend(int idx)
+{
+    while(idx < dimNumber)
+    {
+        counter[idx]++;
+        const double lp = partialLProbs[idx+1] + marginalResults[idx]->get_lProb(counter[idx]);
+
+        if(lp + maxConfsLPSum[idx-1] < Lcutoff)
+        {
+            // Subisotopologues are sorted by probability, so the rest of this marginal is below the threshold too
+            counter[idx] = 0;
+            idx++;
+            continue;
+        }
+
+        // Masses are not sorted though, so only this one subtree can be skipped
+        const double m = partialMasses[idx+1] + marginalResults[idx]->get_mass(counter[idx]);
+        if(m + minMassSum[idx-1] > prune_mmax || m + maxMassSum[idx-1] < prune_mmin)
+            continue;
+
+        partialLProbs[idx] = lp;
+        partialMasses[idx] = m;
+        partialProbs[idx] = partialProbs[idx+1] * marginalResults[idx]->get_prob(counter[idx]);
+
+        idx--;
+        if(idx == 0)
+        {
+            partialLProbs_second_val = *partialLProbs_second;
+            lcfmsv = Lcutoff - partialLProbs_second_val;
+            lProbs_ptr = lProbs_ptr_start;
+            return true;
+        }
+        counter[idx] = -1;
+    }
+
+    terminate_search();
+    return false;
+}
+
+void IsoWindowGenerator::terminate_search()
+{
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        counter[ii] = marginalResults[ii]->get_no_confs()-1;
+        partialLProbs[ii] = -std::numeric_limits<double>::infinity();
+    }
+    partialLProbs[dimNumber] = -std::numeric_limits<double>::infinity();
+    lcfmsv = std::numeric_limits<double>::infinity();
+    lProbs_ptr = lProbs_ptr_start + marginalResults[0]->get_no_confs()-1;
+}
+
+void IsoWindowGenerator::reset()
+{
+    if(empty)
+    {
+        terminate_search();
+        return;
+    }
+
+    partialLProbs[dimNumber] = 0.0;
+    memset(counter, 0, sizeof(int)*dimNumber);
+
+    if(dimNumber == 1)
+    {
+        partialLProbs_second_val = 0.0;
+        lcfmsv = Lcutoff;
+    }
+    else
+    {
+        counter[dimNumber-1] = -1;
+        if(!descend(dimNumber-1))
+            return;
+    }
+
+    lProbs_ptr = lProbs_ptr_start - 1;
+}
+
+IsoWindowGenerator::~IsoWindowGenerator()
+{
+    delete[] counter;
+    delete[] maxConfsLPSum;
+    delete[] minMassSum;
+    delete[] maxMassSum;
     if (marginalResultsUnsorted != marginalResults)
         delete[] marginalResultsUnsorted;
-    dealloc_table(marginalResults, dimNumber);
+    dealloc_marginals(marginalResults, dimNumber, !cachedMarginals.empty());
     if(marginalOrder != nullptr)
         delete[] marginalOrder;
 }
@@ -652,7 +1131,9 @@ IsoThresholdGenerator::~IsoThresholdGenerator()
 
 
 IsoLayeredGenerator::IsoLayeredGenerator(Iso&& iso, int tabSize, int hashSize, bool reorder_marginals, double t_prob_hint)
-: IsoGenerator(std::move(iso))
+: IsoGenerator(std::move(iso)),
+carry_limit(dimNumber-1),
+owns_marginals(true)
 {
     counter = new int[dimNumber];
     maxConfsLPSum = new double[dimNumber-1];
@@ -700,6 +1181,7 @@ IsoLayeredGenerator::IsoLayeredGenerator(Iso&& iso, int tabSize, int hashSize, b
     }
 
     lProbs_ptr_start = marginalResults[0]->get_lProbs_ptr();
+    run_start = lProbs_ptr_start;
 
     if(dimNumber > 1)
         maxConfsLPSum[0] = marginalResults[0]->fastGetModeLProb();
@@ -718,15 +1200,47 @@ IsoLayeredGenerator::IsoLayeredGenerator(Iso&& iso, int tabSize, int hashSize, b
     IsoLayeredGenerator::nextLayer(-0.00001);
 }
 
+IsoLayeredGenerator::IsoLayeredGenerator(const IsoLayeredGenerator& other, int split_dim, const int* range)
+: IsoGenerator(Iso(other, false)),
+counter(new int[dimNumber]),
+maxConfsLPSum(array_copy<double>(other.maxConfsLPSum, dimNumber-1)),
+currentLThreshold(other.currentLThreshold),
+lastLThreshold(other.lastLThreshold),
+marginalResults(other.marginalResults),
+marginalResultsUnsorted(other.marginalResultsUnsorted),
+marginalOrder(other.marginalOrder),
+lProbs_ptr_start(other.lProbs_ptr_start),
+run_start(other.lProbs_ptr_start),
+resetPositions(new const double*[dimNumber]),
+partialLProbs_second(partialLProbs+1),
+marginalsNeedSorting(other.marginalsNeedSorting),
+carry_limit(dimNumber-1),
+owns_marginals(false),
+layerThresholds(other.layerThresholds)
+{
+    // The position nextLayer() started the layer at, never touched by carry()
+    resetPositions[dimNumber-1] = other.resetPositions[dimNumber-1];
+    restrict_to_range(split_dim, range);
+}
+
 bool IsoLayeredGenerator::nextLayer(double offset)
 {
+    return nextLayerAt(currentLThreshold + offset);
+}
+
+bool IsoLayeredGenerator::nextLayerAt(double new_threshold)
+{
+    if(!owns_marginals)
+        return false;
+
     size_t first_mrg_size = marginalResults[0]->get_no_confs();
 
     if(lastLThreshold < getUnlikeliestPeakLProb())
         return false;
 
     lastLThreshold = currentLThreshold;
-    currentLThreshold += offset;
+    currentLThreshold = new_threshold;
+    layerThresholds.push_back(currentLThreshold);
 
     for(int ii = 0; ii < dimNumber; ii++)
     {
@@ -754,7 +1268,7 @@ bool IsoLayeredGenerator::carry()
 
     int * cntr_ptr = counter;
 
-    while(idx < dimNumber-1)
+    while(idx < carry_limit)
     {
         *cntr_ptr = 0;
         idx++;
@@ -793,16 +1307,126 @@ void IsoLayeredGenerator::terminate_search()
     lProbs_ptr = lProbs_ptr_start + marginalResults[0]->get_no_confs()-1;
 }
 
+template<typename F> void IsoLayeredGenerator::walk_work_ranges(int split_dim, F&& f) const
+{
+    walk_outer_counters(marginalResults + split_dim, maxConfsLPSum + split_dim - 1, dimNumber - split_dim, currentLThreshold, std::forward<F>(f));
+}
+
+std::vector<int> IsoLayeredGenerator::get_work_ranges(int split_dim) const
+{
+    return collect_work_ranges([this](int sd, auto&& f) { walk_work_ranges(sd, f); }, dimNumber, split_dim);
+}
+
+int IsoLayeredGenerator::choose_split_dim(size_t min_ranges) const
+{
+    return choose_split_dim_by([this](int sd, auto&& f) { walk_work_ranges(sd, f); }, dimNumber, min_ranges);
+}
+
+void IsoLayeredGenerator::restrict_to_range(int split_dim, const int* range)
+{
+    carry_limit = split_dim-1;
+    memset(counter, 0, sizeof(int)*split_dim);
+    memcpy(counter + split_dim, range, sizeof(int)*(dimNumber - split_dim));
+    recalc(dimNumber-1);
+
+    // Position marginal 0 exactly as the unrestricted generator would on entering the range: the first
+    // range is where nextLayer() leaves it, the others are reached by carry()
+    lProbs_ptr = resetPositions[dimNumber-1];
+    if(std::any_of(range, range + dimNumber - split_dim, [](int c) { return c != 0; }))
+        while(*lProbs_ptr <= last_lcfmsv)
+            lProbs_ptr--;
+
+    for(int ii = 0; ii < split_dim; ii++)
+        resetPositions[ii] = lProbs_ptr;
+}
+
+std::vector<unsigned char> IsoLayeredGenerator::save_cursor() const
+{
+    GeneratorCursor cursor;
+    cursor.carry_limit = carry_limit;
+    cursor.counter.assign(counter, counter + dimNumber);
+    cursor.partialLProbs.assign(partialLProbs, partialLProbs + dimNumber + 1);
+    cursor.partialMasses.assign(partialMasses, partialMasses + dimNumber + 1);
+    cursor.partialProbs.assign(partialProbs, partialProbs + dimNumber + 1);
+    cursor.partialLProbs_second_val = partialLProbs_second_val;
+    cursor.lcfmsv = lcfmsv;
+    cursor.lProbs_offset = lProbs_ptr - lProbs_ptr_start;
+
+    std::vector<unsigned char> blob;
+    cursor.write(blob, layered_cursor_magic, dimNumber);
+
+    const uint32_t no_layers = static_cast<uint32_t>(layerThresholds.size());
+    cursor_write(blob, &last_lcfmsv);
+    cursor_write(blob, &no_layers);
+    cursor_write(blob, layerThresholds.data(), no_layers);
+
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        const int64_t offset = resetPositions[ii] - lProbs_ptr_start;
+        cursor_write(blob, &offset);
+    }
+
+    return blob;
+}
+
+void IsoLayeredGenerator::restore_cursor(const unsigned char* blob, size_t size)
+{
+    const unsigned char* blob_end = blob + size;
+    GeneratorCursor cursor;
+    double blob_last_lcfmsv;
+    uint32_t no_layers;
+
+    cursor.read(blob, blob_end, layered_cursor_magic, dimNumber);
+    cursor_read(blob, blob_end, &blob_last_lcfmsv);
+    cursor_read(blob, blob_end, &no_layers);
+
+    std::vector<double> thresholds(no_layers);
+    cursor_read(blob, blob_end, thresholds.data(), no_layers);
+
+    std::unique_ptr<int64_t[]> reset_offsets(new int64_t[dimNumber]);
+    cursor_read(blob, blob_end, reset_offsets.get(), dimNumber);
+
+    if(no_layers < layerThresholds.size() || !std::equal(layerThresholds.begin(), layerThresholds.end(), thresholds.begin()))
+        throw std::invalid_argument("Generator cursor was saved by a generator of a different molecule, or this one is past the saved layer");
+
+    // Replay the remaining layers, so that the marginals end up exactly as they were
+    for(size_t ii = layerThresholds.size(); ii < no_layers; ii++)
+        if(!nextLayerAt(thresholds[ii]))
+            throw std::invalid_argument("Generator cursor was saved by a generator of a different molecule");
+
+    cursor.check(marginalResults, dimNumber);
+    const int64_t no_confs0 = marginalResults[0]->get_no_confs();
+    for(int ii = 0; ii < dimNumber; ii++)
+        if(reset_offsets[ii] < -1 || reset_offsets[ii] >= no_confs0)
+            throw std::invalid_argument("Generator cursor was saved by a generator of a different molecule");
+
+    carry_limit = cursor.carry_limit;
+    memcpy(counter, cursor.counter.data(), sizeof(int)*dimNumber);
+    memcpy(partialLProbs, cursor.partialLProbs.data(), sizeof(double)*(dimNumber+1));
+    memcpy(partialMasses, cursor.partialMasses.data(), sizeof(double)*(dimNumber+1));
+    memcpy(partialProbs, cursor.partialProbs.data(), sizeof(double)*(dimNumber+1));
+    partialLProbs_second_val = cursor.partialLProbs_second_val;
+    lcfmsv = cursor.lcfmsv;
+    last_lcfmsv = blob_last_lcfmsv;
+    for(int ii = 0; ii < dimNumber; ii++)
+        resetPositions[ii] = lProbs_ptr_start + reset_offsets[ii];
+    lProbs_ptr = lProbs_ptr_start + cursor.lProbs_offset;
+    run_start = lProbs_ptr_start;
+}
+
 IsoLayeredGenerator::~IsoLayeredGenerator()
 {
     delete[] counter;
     delete[] maxConfsLPSum;
     delete[] resetPositions;
-    if (marginalResultsUnsorted != marginalResults)
-        delete[] marginalResultsUnsorted;
-    dealloc_table(marginalResults, dimNumber);
-    if(marginalOrder != nullptr)
-      delete[] marginalOrder;
+    if(owns_marginals)
+    {
+        if (marginalResultsUnsorted != marginalResults)
+            delete[] marginalResultsUnsorted;
+        dealloc_table(marginalResults, dimNumber);
+        if(marginalOrder != nullptr)
+          delete[] marginalOrder;
+    }
 }
 
 
@@ -835,26 +1459,23 @@ IsoGenerator(std::move(iso), false), allocator(dimNumber, _tabSize)
     }
 
     topConf = allocator.newConf();
-    memset(
-            reinterpret_cast<char*>(topConf) + sizeof(double),
-            0,
-            sizeof(int)*dimNumber
-    );
+    memset(topConf, 0, sizeof(int)*dimNumber);
 
-    *(reinterpret_cast<double*>(topConf)) =
-    combinedSum(
-                getConf(topConf),
-                logProbs,
-                dimNumber
-    );
+    modeLProb = combinedSum(topConf, logProbs, dimNumber);
 
-    pq.push(topConf);
+    fringe.resize_and_wipe(1);
+    current_bucket = 0;
+    initialized_until = 1;
+
+    pq.push({modeLProb, topConf});
 }
 
 
 IsoOrderedGenerator::~IsoOrderedGenerator()
 {
     dealloc_table<MarginalTrek*>(marginalResults, dimNumber);
+    for(size_t ii = 0; ii < initialized_until; ii++)
+        fringe[ii].clear();
     delete[] logProbs;
     delete[] masses;
     delete[] marginalConfs;
@@ -866,16 +1487,25 @@ IsoOrderedGenerator::~IsoOrderedGenerator()
 
 bool IsoOrderedGenerator::advanceToNextConfiguration()
 {
-    if(pq.size() < 1)
-        return false;
+    if(pq.empty())
+    {
+        // The current bucket is exhausted, heapify the next non-empty one
+        do
+            current_bucket++;
+        while(current_bucket < initialized_until && fringe[current_bucket].empty());
+
+        if(current_bucket >= initialized_until)
+            return false;
 
+        pq = std::priority_queue<ProbAndConfPtr, pod_vector<ProbAndConfPtr> >(std::less<ProbAndConfPtr>(), pod_vector<ProbAndConfPtr>(std::move(fringe[current_bucket])));
+    }
 
-    topConf = pq.top();
+    currentLProb = pq.top().first;
+    topConf = pq.top().second;
     pq.pop();
 
-    int* topConfIsoCounts = getConf(topConf);
+    int* topConfIsoCounts = topConf;
 
-    currentLProb = *(reinterpret_cast<double*>(topConf));
     currentMass = combinedSum( topConfIsoCounts, masses, dimNumber );
     currentProb = exp(currentLProb);
 
@@ -887,22 +1517,17 @@ bool IsoOrderedGenerator::advanceToNextConfiguration()
             if(ccount == -1)
             {
                 topConfIsoCounts[j]++;
-                *(reinterpret_cast<double*>(topConf)) = combinedSum(topConfIsoCounts, logProbs, dimNumber);
-                pq.push(topConf);
+                push_conf(combinedSum(topConfIsoCounts, logProbs, dimNumber), topConf);
                 topConfIsoCounts[j]--;
                 ccount = j;
             }
             else
             {
-                void* acceptedCandidate = allocator.newConf();
-                int* acceptedCandidateIsoCounts = getConf(acceptedCandidate);
-                memcpy(acceptedCandidateIsoCounts, topConfIsoCounts, confSize);
-
-                acceptedCandidateIsoCounts[j]++;
+                Conf acceptedCandidate = allocator.makeCopy(topConfIsoCounts);
 
-                *(reinterpret_cast<double*>(acceptedCandidate)) = combinedSum(acceptedCandidateIsoCounts, logProbs, dimNumber);
+                acceptedCandidate[j]++;
 
-                pq.push(acceptedCandidate);
+                push_conf(combinedSum(acceptedCandidate, logProbs, dimNumber), acceptedCandidate);
             }
         }
         if(topConfIsoCounts[j] > 0)
@@ -22,7 +22,6 @@
 #include <string>
 #include <vector>
 #include "platform.h"
-#include "dirtyAllocator.h"
 #include "summator.h"
 #include "operators.h"
 #include "marginalTrek++.h"
@@ -176,6 +175,25 @@ class ISOSPEC_EXPORT_SYMBOL Iso {
 };
 
 
+//! The loop behind the for_each_conf() methods of the generators: call f(gen) after each successful advance(), until either returns false.
+/*!
+    advance is a callable, and not a member function pointer, so that the final advancing methods of the generators get
+    called directly and inlined along with f.
+    \return The number of visited configurations.
+*/
+template<typename Generator, typename Advance, typename F> ISOSPEC_FORCE_INLINE size_t for_each_conf(Generator& gen, Advance&& advance, F&& f)
+{
+    size_t visited = 0;
+    while(advance())
+    {
+        visited++;
+        if(!f(gen))
+            break;
+    }
+    return visited;
+}
+
+
 //! The generator of isotopologues.
 /*!
     This class provides the common interface for all isotopic generators.
@@ -237,23 +255,60 @@ class ISOSPEC_EXPORT_SYMBOL IsoOrderedGenerator: public IsoGenerator
 {
  private:
     MarginalTrek**              marginalResults;                    /*!< Table of pointers to marginal distributions of subisotopologues. */
-    std::priority_queue<void*, pod_vector<void*>, ConfOrder> pq;   /*!< The priority queue used to generate isotopologues ordered by descending probability. */
-    void*                       topConf;                            /*!< Most probable configuration. */
-    DirtyAllocator              allocator;                          /*!< Structure used for alocating memory for isotopologues. */
+    std::priority_queue<ProbAndConfPtr, pod_vector<ProbAndConfPtr> > pq;   /*!< The priority queue holding the isotopologues from the current bucket. */
+    pod_vector<unsafe_pod_vector<ProbAndConfPtr> > fringe;          /*!< Unordered buckets of the isotopologues less probable than the current bucket. */
+    Conf                        topConf;                            /*!< Most probable configuration. */
+    Allocator<int>              allocator;                          /*!< Structure used for alocating memory for isotopologues. */
     const pod_vector<double>**  logProbs;                           /*!< Obtained log-probabilities. */
     const pod_vector<double>**  masses;                             /*!< Obtained masses. */
     const pod_vector<Conf>**    marginalConfs;                      /*!< Obtained counts of isotopes. */
     double                      currentLProb;                       /*!< The log-probability of the current isotopologue. */
     double                      currentMass;                        /*!< The mass of the current isotopologue. */
     double                      currentProb;                        /*!< The probability of the current isotopologue. */
+    double                      modeLProb;                          /*!< The log-probability of the most probable isotopologue. */
+    size_t                      current_bucket;
+    size_t                      initialized_until;
     int                         ccount;
 
+    /*! The bucket of an isotopologue: the emitted log-probabilities never go up, so the buckets are visited in order
+        and only the current one needs to be kept as a heap. Everything past the (far away) last bucket lands in it,
+        which is still correct, since the ordering within a bucket is exact. */
+    inline size_t bucket_no(double lprob) const
+    {
+        const double bucket = (modeLProb - lprob) * 100.0;
+        return bucket < 65535.0 ? static_cast<size_t>(bucket) : 65535;
+    }
+
+    ISOSPEC_FORCE_INLINE void push_conf(double lprob, Conf conf)
+    {
+        const size_t bucket_nr = bucket_no(lprob);
+        ISOSPEC_IMPOSSIBLE(bucket_nr < current_bucket);
+
+        if(bucket_nr == current_bucket)
+            pq.push({lprob, conf});
+        else
+        {
+            if(bucket_nr >= initialized_until)
+            {
+                initialized_until = bucket_nr+1;
+                fringe.resize_and_wipe(initialized_until);
+            }
+            fringe[bucket_nr].push_back({lprob, conf});
+        }
+    }
+
  public:
     IsoOrderedGenerator(const IsoOrderedGenerator& other) = delete;
     IsoOrderedGenerator& operator=(const IsoOrderedGenerator& other) = delete;
 
     bool advanceToNextConfiguration() override final;
 
+    //! Call f(*this) for the subsequent configurations, see IsoThresholdGenerator::for_each_conf().
+    template<typename F> ISOSPEC_FORCE_INLINE size_t for_each_conf(F&& f)
+    {
+        return IsoSpec::for_each_conf(*this, [this]() { return IsoOrderedGenerator::advanceToNextConfiguration(); }, std::forward<F>(f));
+    }
+
     //! Save the counts of isotopes in the space.
     /*!
         \param space An array where counts of isotopes shall be written.
@@ -261,7 +316,7 @@ class ISOSPEC_EXPORT_SYMBOL IsoOrderedGenerator: public IsoGenerator
     */
     inline void get_conf_signature(int* space) const override final
     {
-        int* c = getConf(topConf);
+        int* c = topConf;
 
         if (ccount >= 0)
             c[ccount]--;
@@ -304,9 +359,14 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
 
     const double* lProbs_ptr;
     const double* lProbs_ptr_start;
+    const double* run_start;
     double* partialLProbs_second;
     double partialLProbs_second_val, lcfmsv;
     bool empty;
+    int carry_limit;                            /*!< The highest marginal whose counter may be advanced: dimNumber-1, unless restricted to a work range. */
+    bool owns_marginals;                        /*!< False if the marginals are borrowed from another generator. */
+    bool lprobs_only;                           /*!< If true, the masses and probabilities are neither precalculated nor tracked. */
+    std::vector<std::shared_ptr<PrecalculatedMarginal> > cachedMarginals;  /*!< The marginals taken from the MarginalCache, if it is enabled. */
 
  public:
     IsoThresholdGenerator(const IsoThresholdGenerator& other) = delete;
@@ -314,7 +374,13 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
 
     inline void get_conf_signature(int* space) const override final
     {
-        counter[0] = lProbs_ptr - lProbs_ptr_start;
+        get_run_conf_signature(lProbs_ptr - lProbs_ptr_start, space);
+    };
+
+    //! Write the signature of the configuration with the idx-th subisotopologue of marginal 0 in the current run, see advanceToNextRun().
+    inline void get_run_conf_signature(unsigned int idx, int* space) const
+    {
+        counter[0] = idx;
         if(marginalOrder != nullptr)
         {
             for(int ii = 0; ii < dimNumber; ii++)
@@ -342,8 +408,23 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
                          If false, the _threshold is the fraction of the heighest peak's probability.
         \param tabSize The size of the extension of the table with configurations.
         \param hashSize The size of the hash-table used to store subisotopologues and check if they have been already calculated.
+        \param lprobs_only Skip calculating the masses and probabilities of subisotopologues, for when only count_confs(),
+                           lprob() and the configurations are needed: mass(), prob() and the run_masses() and run_probs()
+                           tables are then meaningless. Saves the exp() calls when constructing large marginals.
+    */
+    IsoThresholdGenerator(Iso&& iso, double _threshold, bool _absolute = true, int _tabSize = 1000, int _hashSize = 1000, bool reorder_marginals = true,
+                          bool lprobs_only = false);
+
+    //! Construct a generator restricted to a single work range, sharing the precalculated marginals of another generator.
+    /*!
+        Only the cursor of the generator is allocated anew, which makes this cheap. The other generator must outlive the
+        constructed one, and must not be reset or advanced concurrently with it (the marginals themselves are read-only,
+        so any number of such generators may be used from different threads at once).
+        \param other The generator holding the marginals.
+        \param split_dim The work range splitting point, see get_work_ranges().
+        \param range The work range: dimNumber-split_dim counters of the outer marginals.
     */
-    IsoThresholdGenerator(Iso&& iso, double _threshold, bool _absolute = true, int _tabSize = 1000, int _hashSize = 1000, bool reorder_marginals = true);
+    IsoThresholdGenerator(const IsoThresholdGenerator& other, int split_dim, const int* range);
 
     ~IsoThresholdGenerator();
 
@@ -359,13 +440,115 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
         }
 
         // If we reached this point, a carry is needed
+        return carry();
+    }
+
+    //! Call f(*this) for the subsequent configurations, until f returns false or the configurations run out.
+    /*!
+        The generator is passed to f as IsoThresholdGenerator&, so the calls to mass(), prob() etc. made by f are
+        resolved statically and get inlined into the enumeration loop along with f itself, unlike in a loop calling
+        advanceToNextConfiguration() through an IsoGenerator pointer. On return the generator is left on the last
+        visited configuration.
+        \return The number of visited configurations.
+    */
+    template<typename F> ISOSPEC_FORCE_INLINE size_t for_each_conf(F&& f)
+    {
+        return IsoSpec::for_each_conf(*this, [this]() { return IsoThresholdGenerator::advanceToNextConfiguration(); }, std::forward<F>(f));
+    }
+
+    //! Advance to the next run: the longest stretch of subsequent configurations differing only in the subisotopologue of marginal 0.
+    /*!
+        Within a run the partial sums over the other marginals stay fixed, so the masses and probabilities of its
+        configurations are run_base_mass() + run_masses()[ii] and run_base_prob() * run_probs()[ii] for ii in
+        [run_begin(), run_end()), computed exactly as mass() and prob() would. The generator is left on the last
+        configuration of the run, so this may be freely interleaved with advanceToNextConfiguration().
+        \param max_length The upper limit on the length of the returned run, must be positive. The rest of the run
+                          is returned by the subsequent call.
+        \return False if there are no more configurations, true otherwise.
+    */
+    ISOSPEC_FORCE_INLINE bool advanceToNextRun(size_t max_length = (std::numeric_limits<size_t>::max)())
+    {
+        lProbs_ptr++;
+
+        if(ISOSPEC_UNLIKELY(*lProbs_ptr < lcfmsv) && !carry())
+            return false;
+
+        run_start = lProbs_ptr;
+        const double* run_last = last_not_below(lProbs_ptr, lProbs_ptr_start + marginalResults[0]->get_no_confs(), lcfmsv);
+        if(static_cast<size_t>(run_last - run_start) >= max_length)
+            run_last = run_start + (max_length - 1);
+        lProbs_ptr = run_last;
+
+        return true;
+    }
+
+    inline unsigned int run_begin() const { return run_start - lProbs_ptr_start; }
+    inline unsigned int run_end() const { return lProbs_ptr - lProbs_ptr_start + 1; }
+    inline double run_base_mass() const { return partialMasses[1]; }
+    inline double run_base_prob() const { return partialProbs[1]; }
+    inline double run_base_lprob() const { return partialLProbs_second_val; }
+    inline const double* run_masses() const { return marginalResults[0]->get_masses_ptr(); }
+    inline const double* run_probs() const { return marginalResults[0]->get_probs_ptr(); }
+    inline const double* run_lprobs() const { return lProbs_ptr_start; }
+
+
+    ISOSPEC_FORCE_INLINE double lprob() const override final { return partialLProbs_second_val + (*(lProbs_ptr)); }
+    ISOSPEC_FORCE_INLINE double mass()  const override final { return partialMasses[1] + marginalResults[0]->get_mass(lProbs_ptr - lProbs_ptr_start); }
+    ISOSPEC_FORCE_INLINE double prob()  const override final { return partialProbs[1] * marginalResults[0]->get_prob(lProbs_ptr - lProbs_ptr_start); }
+
+    //! Block the subsequent search of isotopologues.
+    void terminate_search();
+
+    /*! Reset the generator to the beginning of the sequence. Allows it to be reused, eg. to go through the conf space once, calculate
+        the amount of space needed to store configurations, then to allocate that memory, and go through it again, this time saving
+        configurations (and *is* in fact faster than allocating a std::vector and depending on it to grow as needed. This is cheaper
+        than throwing away the generator and making a new one too: marginal distributions don't need to be recalculated. */
+    void reset();
+
+    /*! Count the number of configurations in the distribution. This can be used to pre-allocate enough memory to store it (e.g.
+     * std::vector's reserve() method - this is faster than depending on the vector's dynamic resizing, even though it means that
+     * the configuration space is walked through twice. This method has to be called before the first call to advanceToNextConfiguration
+     * and has undefined results (incl. segfaults) otherwise. The counting stops as soon as more than max_count configurations
+     * are found, returning some number above max_count. */
+    size_t count_confs(size_t max_count = (std::numeric_limits<size_t>::max)());
+
+    /*! Split the configuration space into independent work ranges. A work range is a fixed setting of the counters of
+        marginals split_dim, ..., dimNumber-1 that leaves at least one configuration above the threshold: the generator
+        restricted to it (see restrict_to_range()) walks through all the settings of the remaining, inner, marginals.
+        The ranges are returned in the order in which the unrestricted generator visits them, each one taking
+        dimNumber-split_dim consecutive entries of the returned vector, so that concatenating their configurations
+        reproduces the whole sequence. split_dim must be in [1, dimNumber-1]. */
+    std::vector<int> get_work_ranges(int split_dim) const;
+
+    //! Pick the largest split_dim (the coarsest splitting) that produces at least min_ranges work ranges, if possible.
+    int choose_split_dim(size_t min_ranges) const;
+
+    //! Restrict the generator to a single work range (see get_work_ranges()) and rewind it to the beginning of that range.
+    void restrict_to_range(int split_dim, const int* range);
+
+    //! Serialize the current position of the generator (including its work range, if restricted) into a compact binary blob.
+    std::vector<unsigned char> save_cursor() const;
+
+    /*! Move the generator to the position saved by save_cursor(). The marginals are not part of the cursor, so the generator
+        must be constructed from the same molecule, with the same parameters, as the one that saved it: this is checked as far
+        as possible, and std::invalid_argument is thrown on a mismatch. This makes it possible to checkpoint a long enumeration
+        and resume it later, or in a different process. */
+    void restore_cursor(const unsigned char* blob, size_t size);
+
+ private:
+    template<typename F> void walk_work_ranges(int split_dim, F&& f) const;
 
+    void untrack_masses_and_probs();
+
+    //! Move to the next setting of the counters of marginals 1..carry_limit above the threshold, rewinding marginal 0.
+    ISOSPEC_FORCE_INLINE bool carry()
+    {
         int idx = 0;
         lProbs_ptr = lProbs_ptr_start;
 
         int * cntr_ptr = counter;
 
-        while(idx < dimNumber-1)
+        while(idx < carry_limit)
         {
             // counter[idx] = 0;
             *cntr_ptr = 0;
@@ -376,8 +559,11 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
             partialLProbs[idx] = partialLProbs[idx+1] + marginalResults[idx]->get_lProb(counter[idx]);
             if(partialLProbs[idx] + maxConfsLPSum[idx-1] >= Lcutoff)
             {
-                partialMasses[idx] = partialMasses[idx+1] + marginalResults[idx]->get_mass(counter[idx]);
-                partialProbs[idx] = partialProbs[idx+1] * marginalResults[idx]->get_prob(counter[idx]);
+                if(ISOSPEC_LIKELY(!lprobs_only))
+                {
+                    partialMasses[idx] = partialMasses[idx+1] + marginalResults[idx]->get_mass(counter[idx]);
+                    partialProbs[idx] = partialProbs[idx+1] * marginalResults[idx]->get_prob(counter[idx]);
+                }
                 recalc(idx-1);
                 return true;
             }
@@ -388,29 +574,14 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
     }
 
 
-    ISOSPEC_FORCE_INLINE double lprob() const override final { return partialLProbs_second_val + (*(lProbs_ptr)); }
-    ISOSPEC_FORCE_INLINE double mass()  const override final { return partialMasses[1] + marginalResults[0]->get_mass(lProbs_ptr - lProbs_ptr_start); }
-    ISOSPEC_FORCE_INLINE double prob()  const override final { return partialProbs[1] * marginalResults[0]->get_prob(lProbs_ptr - lProbs_ptr_start); }
-
-    //! Block the subsequent search of isotopologues.
-    void terminate_search();
-
-    /*! Reset the generator to the beginning of the sequence. Allows it to be reused, eg. to go through the conf space once, calculate
-        the amount of space needed to store configurations, then to allocate that memory, and go through it again, this time saving
-        configurations (and *is* in fact faster than allocating a std::vector and depending on it to grow as needed. This is cheaper
-        than throwing away the generator and making a new one too: marginal distributions don't need to be recalculated. */
-    void reset();
-
-    /*! Count the number of configurations in the distribution. This can be used to pre-allocate enough memory to store it (e.g.
-     * std::vector's reserve() method - this is faster than depending on the vector's dynamic resizing, even though it means that
-     * the configuration space is walked through twice. This method has to be called before the first call to advanceToNextConfiguration
-     * and has undefined results (incl. segfaults) otherwise. */
-    size_t count_confs();
-
- private:
     //! Recalculate the current partial log-probabilities, masses, and probabilities.
     ISOSPEC_FORCE_INLINE void recalc(int idx)
     {
+        if(ISOSPEC_UNLIKELY(lprobs_only))
+        {
+            short_recalc(idx);
+            return;
+        }
         for(; idx > 0; idx--)
         {
             partialLProbs[idx] = partialLProbs[idx+1] + marginalResults[idx]->get_lProb(counter[idx]);
@@ -434,6 +605,128 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
 
 
 
+//! The generator of isotopologues above a given threshold value and within a given mass window.
+/*!
+    Walks the same configuration space as the IsoThresholdGenerator, but along with the bounds on the log-probabilities of
+    the remaining marginals it keeps the bounds on their masses, and skips whole subtrees of configurations whose masses
+    cannot fall within [mmin, mmax]. This makes it much faster than generating the whole envelope and filtering it, when
+    the window is narrow. The configurations are not ordered.
+*/
+class ISOSPEC_EXPORT_SYMBOL IsoWindowGenerator: public IsoGenerator
+{
+ private:
+    int*                    counter;            /*!< An array storing the position of an isotopologue in terms of the subisotopologues ordered by decreasing probability. */
+    double*                 maxConfsLPSum;
+    double*                 minMassSum;         /*!< minMassSum[ii] is the sum of the lowest masses of the subisotopologues of marginals 0..ii. */
+    double*                 maxMassSum;         /*!< maxMassSum[ii] is the sum of the highest masses of the subisotopologues of marginals 0..ii. */
+    const double            Lcutoff;            /*!< The logarithm of the lower bound on the calculated probabilities. */
+    const double            mmin;               /*!< The lower end of the mass window. */
+    const double            mmax;               /*!< The upper end of the mass window. */
+    PrecalculatedMarginal** marginalResults;
+    PrecalculatedMarginal** marginalResultsUnsorted;
+    int* marginalOrder;
+
+    const double* lProbs_ptr;
+    const double* lProbs_ptr_start;
+    const double* masses_ptr_start;
+    double* partialLProbs_second;
+    double partialLProbs_second_val, lcfmsv;
+    double prune_mmin, prune_mmax;              /*!< The mass window widened by the possible rounding errors, used to prune the subtrees. */
+    bool empty;
+    std::vector<std::shared_ptr<PrecalculatedMarginal> > cachedMarginals;  /*!< The marginals taken from the MarginalCache, if it is enabled. */
+
+ public:
+    IsoWindowGenerator(const IsoWindowGenerator& other) = delete;
+    IsoWindowGenerator& operator=(const IsoWindowGenerator& other) = delete;
+
+    inline void get_conf_signature(int* space) const override final
+    {
+        counter[0] = lProbs_ptr - lProbs_ptr_start;
+        if(marginalOrder != nullptr)
+        {
+            for(int ii = 0; ii < dimNumber; ii++)
+            {
+                int jj = marginalOrder[ii];
+                memcpy(space, marginalResultsUnsorted[ii]->get_conf(counter[jj]), isotopeNumbers[ii]*sizeof(int));
+                space += isotopeNumbers[ii];
+            }
+        }
+        else
+        {
+            for(int ii = 0; ii < dimNumber; ii++)
+            {
+                memcpy(space, marginalResultsUnsorted[ii]->get_conf(counter[ii]), isotopeNumbers[ii]*sizeof(int));
+                space += isotopeNumbers[ii];
+            }
+        }
+    };
+
+    //! The move-constructor.
+    /*!
+        \param iso An instance of the Iso class.
+        \param _mmin The lower end of the mass window.
+        \param _mmax The upper end of the mass window.
+        \param _threshold The threshold value, see IsoThresholdGenerator. Zero means no threshold at all, which is only
+                          feasible for small molecules: the window only prunes configurations by their mass.
+        \param _absolute If true, the _threshold is interpreted as the absolute minimal peak height for the isotopologues.
+                         If false, the _threshold is the fraction of the heighest peak's probability.
+        \param tabSize The size of the extension of the table with configurations.
+        \param hashSize The size of the hash-table used to store subisotopologues and check if they have been already calculated.
+    */
+    IsoWindowGenerator(Iso&& iso, double _mmin, double _mmax, double _threshold, bool _absolute = true, int _tabSize = 1000, int _hashSize = 1000, bool reorder_marginals = true);
+
+    ~IsoWindowGenerator();
+
+    ISOSPEC_FORCE_INLINE bool advanceToNextConfiguration() override final
+    {
+        do
+        {
+            lProbs_ptr++;
+
+            if(ISOSPEC_UNLIKELY(*lProbs_ptr < lcfmsv) && !carry())
+                return false;
+        }
+        while(!in_window());
+
+        return true;
+    }
+
+    //! Call f(*this) for the subsequent configurations, see IsoThresholdGenerator::for_each_conf().
+    template<typename F> ISOSPEC_FORCE_INLINE size_t for_each_conf(F&& f)
+    {
+        return IsoSpec::for_each_conf(*this, [this]() { return IsoWindowGenerator::advanceToNextConfiguration(); }, std::forward<F>(f));
+    }
+
+    ISOSPEC_FORCE_INLINE double lprob() const override final { return partialLProbs_second_val + (*(lProbs_ptr)); }
+    ISOSPEC_FORCE_INLINE double mass()  const override final { return partialMasses[1] + masses_ptr_start[lProbs_ptr - lProbs_ptr_start]; }
+    ISOSPEC_FORCE_INLINE double prob()  const override final { return partialProbs[1] * marginalResults[0]->get_prob(lProbs_ptr - lProbs_ptr_start); }
+
+    //! Block the subsequent search of isotopologues.
+    void terminate_search();
+
+    //! Reset the generator to the beginning of the sequence, see IsoThresholdGenerator::reset().
+    void reset();
+
+ private:
+    ISOSPEC_FORCE_INLINE bool in_window() const
+    {
+        const double m = mass();
+        return mmin <= m && m <= mmax;
+    }
+
+    //! Move to the next setting of the counters of marginals 1..dimNumber-1 that may hold a configuration within the window, rewinding marginal 0.
+    ISOSPEC_FORCE_INLINE bool carry()
+    {
+        counter[0] = 0;
+        return descend(1);
+    }
+
+    //! Advance the counter of marginal idx and go down to marginal 0, skipping the subtrees that are below the threshold or outside the window.
+    bool descend(int idx);
+};
+
+
+
 
 
 class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
@@ -448,10 +741,14 @@ class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
 
     const double* lProbs_ptr;
     const double* lProbs_ptr_start;
+    const double* run_start;
     const double** resetPositions;
     double* partialLProbs_second;
     double partialLProbs_second_val, lcfmsv, last_lcfmsv;
     bool marginalsNeedSorting;
+    int carry_limit;                            /*!< The highest marginal whose counter may be advanced: dimNumber-1, unless restricted to a work range. */
+    bool owns_marginals;                        /*!< False if the marginals are borrowed from another generator. */
+    std::vector<double> layerThresholds;        /*!< The thresholds of all the layers so far: the layout of the marginals depends on them. */
 
 
  public:
@@ -460,7 +757,13 @@ class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
 
     inline void get_conf_signature(int* space) const override final
     {
-        counter[0] = lProbs_ptr - lProbs_ptr_start;
+        get_run_conf_signature(lProbs_ptr - lProbs_ptr_start, space);
+    };
+
+    //! Write the signature of the configuration with the idx-th subisotopologue of marginal 0 in the current run, see advanceToNextRun().
+    inline void get_run_conf_signature(unsigned int idx, int* space) const
+    {
+        counter[0] = idx;
         if(marginalOrder != nullptr)
         {
             for(int ii = 0; ii < dimNumber; ii++)
@@ -484,6 +787,14 @@ class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
 
     IsoLayeredGenerator(Iso&& iso, int _tabSize = 1000, int _hashSize = 1000, bool reorder_marginals = true, double t_prob_hint = 0.99);  // NOLINT(runtime/explicit) - constructor deliberately left to be used as a conversion
 
+    //! Construct a generator restricted to a single work range of the current layer of another generator, sharing its marginals.
+    /*!
+        See IsoThresholdGenerator's analogous constructor. The constructed generator walks through the configurations
+        of the range that belong to the current layer of the other one and stops there: it cannot move on to the next
+        layer, as that would require extending the shared marginals. It is invalidated by other.nextLayer().
+    */
+    IsoLayeredGenerator(const IsoLayeredGenerator& other, int split_dim, const int* range);
+
     ~IsoLayeredGenerator();
 
     ISOSPEC_FORCE_INLINE bool advanceToNextConfiguration() override final
@@ -508,6 +819,58 @@ class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
         return false;
     }
 
+    //! Call f(*this) for the subsequent configurations, see IsoThresholdGenerator::for_each_conf().
+    template<typename F> ISOSPEC_FORCE_INLINE size_t for_each_conf(F&& f)
+    {
+        return IsoSpec::for_each_conf(*this, [this]() { return IsoLayeredGenerator::advanceToNextConfiguration(); }, std::forward<F>(f));
+    }
+
+    //! Like for_each_conf(), but doesn't go past the current layer.
+    template<typename F> ISOSPEC_FORCE_INLINE size_t for_each_conf_within_layer(F&& f)
+    {
+        return IsoSpec::for_each_conf(*this, [this]() { return advanceToNextConfigurationWithinLayer(); }, std::forward<F>(f));
+    }
+
+    //! Advance to the next run of configurations differing only in the subisotopologue of marginal 0, see IsoThresholdGenerator::advanceToNextRun().
+    ISOSPEC_FORCE_INLINE bool advanceToNextRun(size_t max_length = (std::numeric_limits<size_t>::max)())
+    {
+        do
+        {
+            if(advanceToNextRunWithinLayer(max_length))
+                return true;
+        } while(IsoLayeredGenerator::nextLayer(-2.0));
+        return false;
+    }
+
+    ISOSPEC_FORCE_INLINE bool advanceToNextRunWithinLayer(size_t max_length = (std::numeric_limits<size_t>::max)())
+    {
+        do{
+            lProbs_ptr++;
+
+            if(ISOSPEC_LIKELY(*lProbs_ptr >= lcfmsv))
+            {
+                run_start = lProbs_ptr;
+                const double* run_last = last_not_below(lProbs_ptr, lProbs_ptr_start + marginalResults[0]->get_no_confs(), lcfmsv);
+                if(static_cast<size_t>(run_last - run_start) >= max_length)
+                    run_last = run_start + (max_length - 1);
+                lProbs_ptr = run_last;
+                return true;
+            }
+        }
+        while(carry());  // NOLINT(whitespace/empty_loop_body) - cpplint bug, that's not an empty loop body, that's a do{...}while(...) construct
+        return false;
+    }
+
+    // The pointers are invalidated by nextLayer(), so these have to be re-read after each new run.
+    inline unsigned int run_begin() const { return run_start - lProbs_ptr_start; }
+    inline unsigned int run_end() const { return lProbs_ptr - lProbs_ptr_start + 1; }
+    inline double run_base_mass() const { return partialMasses[1]; }
+    inline double run_base_prob() const { return partialProbs[1]; }
+    inline double run_base_lprob() const { return partialLProbs_second_val; }
+    inline const double* run_masses() const { return marginalResults[0]->get_masses_ptr(); }
+    inline const double* run_probs() const { return marginalResults[0]->get_probs_ptr(); }
+    inline const double* run_lprobs() const { return lProbs_ptr_start; }
+
     ISOSPEC_FORCE_INLINE double lprob() const override final { return partialLProbs_second_val + (*(lProbs_ptr)); };
     ISOSPEC_FORCE_INLINE double mass()  const override final { return partialMasses[1] + marginalResults[0]->get_mass(lProbs_ptr - lProbs_ptr_start); };
     ISOSPEC_FORCE_INLINE double prob()  const override final { return partialProbs[1] * marginalResults[0]->get_prob(lProbs_ptr - lProbs_ptr_start); };
@@ -531,9 +894,32 @@ class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
         last_lcfmsv = lastLThreshold - partialLProbs_second_val;
     }
 
+    //! Extend the marginals and move on to the next layer. Returns false if there are no more layers, or if the marginals are not ours to extend.
     bool nextLayer(double offset);
 
+    //! Split the current layer into work ranges, see IsoThresholdGenerator::get_work_ranges().
+    std::vector<int> get_work_ranges(int split_dim) const;
+
+    //! Pick the split_dim for the current layer, see IsoThresholdGenerator::choose_split_dim().
+    int choose_split_dim(size_t min_ranges) const;
+
+    //! Restrict the generator to a single work range of the current layer and rewind it to the beginning of that range.
+    void restrict_to_range(int split_dim, const int* range);
+
+    //! Serialize the current position of the generator, along with the thresholds of the layers so far, see IsoThresholdGenerator::save_cursor().
+    std::vector<unsigned char> save_cursor() const;
+
+    /*! Move the generator to the position saved by save_cursor(), see IsoThresholdGenerator::restore_cursor(). The marginals
+        are extended through the same sequence of layers as they were in the generator that saved the cursor, which
+        reproduces their state (and so the meaning of the counters) exactly. Thus the generator must not be past the
+        layer of the saved position. */
+    void restore_cursor(const unsigned char* blob, size_t size);
+
  private:
+    template<typename F> void walk_work_ranges(int split_dim, F&& f) const;
+
+    bool nextLayerAt(double new_threshold);
+
     bool carry();
 };
 
@@ -562,6 +948,12 @@ class IsoStochasticGenerator : public IsoGenerator
 
     ISOSPEC_FORCE_INLINE void get_conf_signature(int* space) const override final { ILG.get_conf_signature(space); }
 
+    //! Call f(*this) for the subsequent configurations, see IsoThresholdGenerator::for_each_conf().
+    template<typename F> ISOSPEC_FORCE_INLINE size_t for_each_conf(F&& f)
+    {
+        return IsoSpec::for_each_conf(*this, [this]() { return IsoStochasticGenerator::advanceToNextConfiguration(); }, std::forward<F>(f));
+    }
+
     ISOSPEC_FORCE_INLINE bool advanceToNextConfiguration() override final
     {
         /* This function will be used mainly in very small, tight loops, therefore it makes sense to
@@ -19,6 +19,7 @@
 #include <algorithm>
 #include <vector>
 #include <cstdlib>
+#include <cstdint>
 #include <queue>
 #include <utility>
 #include <cstring>
@@ -54,6 +55,22 @@ void writeInitialConfiguration(const int atomCnt, const int isotopeNo, const dou
     We start from the point close to the mean of the underlying multinomial distribution.
     */
 
+    if(isotopeNo == 2)
+    {
+        // Binomial: the mode is floor((n+1)p). Only rounding can put us off by one, so just check the neighbours, settling
+        // ties towards fewer atoms of the second isotope, as the hill climbing below would.
+        int k = static_cast<int>(floor((atomCnt + 1) * exp(lprobs[1])));
+        k = (std::max)(0, (std::min)(k, atomCnt));
+        auto lp = [&](int kk) { const int conf[2] = {atomCnt - kk, kk}; return unnormalized_logProb(conf, lprobs, 2); };
+        while(k < atomCnt && lp(k+1) > lp(k))
+            k++;
+        while(k > 0 && lp(k-1) >= lp(k))
+            k--;
+        res[0] = atomCnt - k;
+        res[1] = k;
+        return;
+    }
+
     // This approximates the mode (heuristics: the mean is close to the mode).
     for(int i = 0; i < isotopeNo; ++i)
         res[i] = static_cast<int>( atomCnt * exp(lprobs[i]) ) + 1;
@@ -247,6 +264,87 @@ void Marginal::setupMode()
 }
 
 
+void Marginal::binomial_extend(int& k_down, int& k_up, double lCutOff, bool layered, BinomialOrder order,
+                               pod_vector<int>& confs, pod_vector<double>& lprobs) const
+{
+    ISOSPEC_IMPOSSIBLE(isotopeNo != 2);
+    const int n = atomCnt;
+    const int mode_k = mode_conf[1];
+
+    // The log-probabilities are summed up in the same order as the generic explorations do, so that the results are the
+    // same to the last bit. LayeredMarginal compares the unnormalized ones against the threshold less loggamma_nominator.
+    // PrecalculatedMarginal gets (n-k, k) from the neighbour towards the mode, adding the terms of the isotope moved to
+    // the partial sum of the preceding ones.
+    auto lprob = [&](int k)
+    {
+        const int conf[2] = {n - k, k};
+        if(layered)
+            return unnormalized_logProb(conf);
+        if(k == mode_k)
+            return mode_lprob;
+        if(k > mode_k)
+            return loggamma_nominator + (minuslogFactorial(conf[0]) + conf[0] * atom_lProbs[0]) + minuslogFactorial(conf[1]) + conf[1] * atom_lProbs[1];
+        return loggamma_nominator + minuslogFactorial(conf[0]) + conf[0] * atom_lProbs[0] + (minuslogFactorial(conf[1]) + conf[1] * atom_lProbs[1]);
+    };
+    const double offset = layered ? loggamma_nominator : 0.0;
+    if(layered)
+        lCutOff -= loggamma_nominator;
+
+    // The two descending runs, downwards from k_down and upwards from k_up
+    pod_vector<double> down, up;
+    for(double lp; k_down >= 0 && (lp = lprob(k_down)) >= lCutOff; k_down--)
+        down.push_back(lp);
+    for(double lp; k_up <= n && (lp = lprob(k_up)) >= lCutOff; k_up++)
+        up.push_back(lp);
+
+    size_t idx_down = 0, idx_up = 0;
+    const int start_down = k_down + static_cast<int>(down.size());
+    const int start_up = k_up - static_cast<int>(up.size());
+    auto append_down = [&]()
+    {
+        const int k = start_down - static_cast<int>(idx_down);
+        confs.push_back(n - k);
+        confs.push_back(k);
+        lprobs.push_back(down[idx_down++] + offset);
+    };
+    auto append_up = [&]()
+    {
+        const int k = start_up + static_cast<int>(idx_up);
+        confs.push_back(n - k);
+        confs.push_back(k);
+        lprobs.push_back(up[idx_up++] + offset);
+    };
+
+    switch(order)
+    {
+        case BinomialOrder::descending:
+            while(idx_down < down.size() && idx_up < up.size())
+                if(down[idx_down] >= up[idx_up])
+                    append_down();
+                else
+                    append_up();
+            break;
+        case BinomialOrder::alternating:
+            while(idx_down < down.size() && idx_up < up.size())
+            {
+                append_down();
+                append_up();
+            }
+            break;
+        case BinomialOrder::up_first:
+            while(idx_up < up.size())
+                append_up();
+            break;
+        case BinomialOrder::down_first:
+            break;
+    }
+    while(idx_down < down.size())
+        append_down();
+    while(idx_up < up.size())
+        append_up();
+}
+
+
 double Marginal::getLightestConfMass() const
 {
     double ret_mass = std::numeric_limits<double>::infinity();
@@ -440,30 +538,72 @@ MarginalTrek::~MarginalTrek()
 
 
 
+//! Round the size of a table up so that the next one starts on a cache line.
+static inline size_t cache_line_round_up(size_t bytes)
+{
+    return (bytes + ISOSPEC_CACHE_LINE_SIZE - 1) / ISOSPEC_CACHE_LINE_SIZE * ISOSPEC_CACHE_LINE_SIZE;
+}
+
+//! Append a copy of the isotopeNo-long row conf to the table, returning a pointer to the copy (valid until the next append).
+static ISOSPEC_FORCE_INLINE int* append_conf(pod_vector<int>& table, const int* conf, unsigned int isotopeNo)
+{
+    const size_t off = table.size();
+    table.resize(off + isotopeNo);
+    int* ret = table.data() + off;
+    memcpy(ret, conf, isotopeNo * sizeof(int));
+    return ret;
+}
+
+//! Sort the rows of a configuration table (with their lprobs) by descending lprob, gathering the rows into sorted_confs.
+static void sort_conf_rows(double* lprobs, const int* confs, int* sorted_confs, size_t no_confs, unsigned int isotopeNo)
+{
+    std::unique_ptr<unsigned int[]> order(new unsigned int[no_confs]);
+    radix_sort_descending(lprobs, order.get(), no_confs);
+
+    for(size_t ii = 0; ii < no_confs; ii++)
+        memcpy(sorted_confs + ii * isotopeNo, confs + static_cast<size_t>(order[ii]) * isotopeNo, isotopeNo * sizeof(int));
+}
+
 PrecalculatedMarginal::PrecalculatedMarginal(Marginal&& m,
-    double lCutOff,
+    double _lCutOff,
     bool sort,
-    int tabSize,
-    int
+    int,
+    int,
+    bool lprobs_only
 ) : Marginal(std::move(m)),
-allocator(isotopeNo, tabSize)
+lCutOff(_lCutOff),
+storage(nullptr)
 {
-    Conf currentConf = allocator.makeCopy(mode_conf);
-    if(logProb(currentConf) >= lCutOff)
+    // Explore into growable tables first, the final layout is only known when we're done.
+    pod_vector<int> conf_table(16 * isotopeNo);
+    pod_vector<double> lprob_table;
+
+    if(isotopeNo == 2)
+    {
+        int k_down = mode_conf[1];
+        int k_up = mode_conf[1] + 1;
+        binomial_extend(k_down, k_up, lCutOff, false, sort ? BinomialOrder::descending : BinomialOrder::alternating, conf_table, lprob_table);
+        store(conf_table, lprob_table, false, lprobs_only);  // Already sorted
+        return;
+    }
+
+    if(logProb(mode_conf) >= lCutOff)
     {
-        configurations.push_back(currentConf);
-        lProbs.push_back(mode_lprob);
+        append_conf(conf_table, mode_conf, isotopeNo);
+        lprob_table.push_back(mode_lprob);
     }
 
-    unsigned int idx = 0;
+    size_t idx = 0;
 
+    std::unique_ptr<int[]> currentConf(new int[isotopeNo]);
     std::unique_ptr<double[]> prob_partials(new double[isotopeNo]);
     std::unique_ptr<double[]> prob_part_acc(new double[isotopeNo+1]);
     prob_part_acc[0] = loggamma_nominator;
 
-    while(idx < configurations.size())
+    while(idx < lprob_table.size())
     {
-        currentConf = configurations[idx];
+        // A copy, as appending to conf_table may move its contents
+        memcpy(currentConf.get(), conf_table.data() + idx * isotopeNo, isotopeNo * sizeof(int));
         idx++;
 
         for(size_t ii = 0; ii < isotopeNo; ii++)
@@ -495,10 +635,8 @@ allocator(isotopeNo, tabSize)
 
                         if (logp >= lCutOff)
                         {
-                            auto tmp = allocator.makeCopy(currentConf);
-                            tmp[jj]++;
-                            configurations.push_back(tmp);
-                            lProbs.push_back(logp);
+                            append_conf(conf_table, currentConf.get(), isotopeNo)[jj]++;
+                            lprob_table.push_back(logp);
                         }
                     }
                     else
@@ -516,35 +654,216 @@ allocator(isotopeNo, tabSize)
         }
     }
 
-    no_confs = configurations.size();
-    confs  = configurations.data();
+    store(conf_table, lprob_table, sort, lprobs_only);
+}
+
+
+void PrecalculatedMarginal::store(pod_vector<int>& conf_table, pod_vector<double>& lprob_table, bool sort, bool lprobs_only)
+{
+    no_confs = lprob_table.size();
+
+    // The layout is: the configurations, then lProbs, probs and masses, each starting on a cache line. As the configurations
+    // go first, when they don't need sorting their table is just extended in place into the final block, without copying.
+    const size_t confs_size = static_cast<size_t>(no_confs) * isotopeNo * sizeof(int);
+    const size_t lProbs_size = cache_line_round_up((no_confs + 1) * sizeof(double));
+    const size_t doubles_size = cache_line_round_up(no_confs * sizeof(double));
+    const size_t storage_size = confs_size + ISOSPEC_CACHE_LINE_SIZE + lProbs_size + 2 * doubles_size;
 
     if(sort && no_confs > 0)
     {
-            std::unique_ptr<size_t[]> order_arr(get_inverse_order(lProbs.data(), no_confs));
-            impose_order(order_arr.get(), no_confs, lProbs.data(), confs);
+        storage = malloc(storage_size);
+        if(storage == nullptr)
+            throw std::bad_alloc();
+        sort_conf_rows(lprob_table.data(), conf_table.data(), reinterpret_cast<int*>(storage), no_confs, isotopeNo);
+        conf_table.clear();
+    }
+    else
+    {
+        storage = realloc(conf_table.data(), storage_size);
+        if(storage == nullptr)
+            throw std::bad_alloc();
+        conf_table.release();
     }
 
-    probs = new double[no_confs];
-    masses = new double[no_confs];
+    confs = reinterpret_cast<int*>(storage);
+    char* tables = reinterpret_cast<char*>(cache_line_round_up(reinterpret_cast<uintptr_t>(storage) + confs_size));
+    lProbs = reinterpret_cast<double*>(tables);
+    probs = reinterpret_cast<double*>(tables + lProbs_size);
+    masses = reinterpret_cast<double*>(tables + lProbs_size + doubles_size);
 
+    if(no_confs > 0)
+        memcpy(lProbs, lprob_table.data(), no_confs * sizeof(double));
 
-    for(unsigned int ii = 0; ii < no_confs; ii++)
+    lProbs[no_confs] = -std::numeric_limits<double>::infinity();
+
+    if(!lprobs_only)
+        materialize();
+}
+
+PrecalculatedMarginal::PrecalculatedMarginal(const std::shared_ptr<const PrecalculatedMarginal>& base, double _lCutOff)
+: Marginal(*base),
+lCutOff(_lCutOff),
+storage(nullptr),
+prefix_of(base)
+{
+    no_confs = std::partition_point(base->lProbs, base->lProbs + base->no_confs, [this](double lprob) { return lprob >= lCutOff; }) - base->lProbs;
+
+    storage = malloc((no_confs + 1) * sizeof(double));
+    if(storage == nullptr)
+        throw std::bad_alloc();
+
+    lProbs = reinterpret_cast<double*>(storage);
+    memcpy(lProbs, base->lProbs, no_confs * sizeof(double));
+    lProbs[no_confs] = -std::numeric_limits<double>::infinity();
+
+    probs = base->probs;
+    masses = base->masses;
+    confs = base->confs;
+}
+
+void PrecalculatedMarginal::materialize() const
+{
+    if(prefix_of)
     {
+        prefix_of->materialize();
+        return;
+    }
+    std::call_once(materialized, &PrecalculatedMarginal::fill_probs_and_masses, this);
+}
+
+void PrecalculatedMarginal::fill_probs_and_masses() const
+{
+    // Separate passes, so that the exp() one is a plain loop over contiguous arrays, which the compiler may vectorize
+    for(unsigned int ii = 0; ii < no_confs; ii++)
         probs[ii] = exp(lProbs[ii]);
-        masses[ii] = calc_mass(confs[ii], atom_masses, isotopeNo);
+
+    const int* conf = confs;
+    for(unsigned int ii = 0; ii < no_confs; ii++, conf += isotopeNo)
+        masses[ii] = calc_mass(conf, atom_masses, isotopeNo);
+}
+
+//! The log-probability the exploration in PrecalculatedMarginal's constructor computes for conf, the same to the last bit.
+/*!
+    Apart from the mode, that exploration reaches each subisotopologue c from a neighbour with one atom less of the first
+    isotope jj with c_jj above the mode, and one more of another isotope. Its log-probability is the sum of the terms of the
+    isotopes in their order, with those of jj added to the partial sum of the preceding ones.
+*/
+static double explored_lprob(const int* c, const int* mode_conf, double mode_lprob, double loggamma_nominator,
+                             const double* atom_lProbs, unsigned int isotopeNo)
+{
+    unsigned int jj = 0;
+    while(jj < isotopeNo && c[jj] <= mode_conf[jj])
+        jj++;
+
+    if(jj == isotopeNo)
+        return mode_lprob;  // No isotope above the mode, and as many atoms: that's the mode
+
+    double ret = loggamma_nominator;
+    for(unsigned int kk = 0; kk < jj; kk++)
+        ret += minuslogFactorial(c[kk]) + c[kk] * atom_lProbs[kk];
+    ret = ret + minuslogFactorial(c[jj]) + c[jj] * atom_lProbs[jj];
+    for(unsigned int kk = jj+1; kk < isotopeNo; kk++)
+        ret += minuslogFactorial(c[kk]) + c[kk] * atom_lProbs[kk];
+    return ret;
+}
+
+PrecalculatedMarginal::PrecalculatedMarginal(Marginal&& m,
+    const PrecalculatedMarginal& base,
+    const PrecalculatedMarginal& step,
+    double _lCutOff,
+    bool sort,
+    bool lprobs_only
+) : Marginal(std::move(m)),
+lCutOff(_lCutOff),
+storage(nullptr)
+{
+    for(const PrecalculatedMarginal* other : {&base, &step})
+        if(other->isotopeNo != isotopeNo ||
+           !std::equal(atom_lProbs, atom_lProbs + isotopeNo, other->atom_lProbs) ||
+           !std::equal(atom_masses, atom_masses + isotopeNo, other->atom_masses))
+            throw std::invalid_argument("The base and step marginals must be of the same element");
+
+    if(base.atomCnt + step.atomCnt != atomCnt)
+        throw std::invalid_argument("The numbers of atoms of the base and step marginals must add up to that of the result");
+
+    if(base.lCutOff > lCutOff || step.lCutOff != -std::numeric_limits<double>::infinity())
+        throw std::invalid_argument("The base marginal must have been precalculated with a cutoff not greater than the requested one, and the step one with none");
+
+    ensureModeConf();
+
+    std::unique_ptr<double[]> inv_probs(new double[isotopeNo]);
+    for(unsigned int ii = 0; ii < isotopeNo; ii++)
+        inv_probs[ii] = exp(-atom_lProbs[ii]);
+
+    // The configurations of step, grouped by the set of isotopes present in them
+    const size_t no_supports = static_cast<size_t>(1) << isotopeNo;
+    std::vector<std::vector<unsigned int>> by_support(no_supports);
+    for(unsigned int dd = 0; dd < step.no_confs; dd++)
+    {
+        const int* d = step.confs + static_cast<size_t>(dd) * isotopeNo;
+        size_t support = 0;
+        for(unsigned int ii = 0; ii < isotopeNo; ii++)
+            if(d[ii] > 0)
+                support |= static_cast<size_t>(1) << ii;
+        by_support[support].push_back(dd);
     }
 
-    lProbs.push_back(-std::numeric_limits<double>::infinity());
+    std::unique_ptr<int[]> child(new int[isotopeNo]);
+    pod_vector<int> conf_table(16 * isotopeNo);
+    pod_vector<double> lprob_table;
+
+    // Going from c (atomCnt atoms) to the most probable of the subisotopologues with one atom less, c without one atom of
+    // the isotope ii maximizing c_ii / p_ii (the lowest such ii on ties), never decreases the probability. So the ancestor
+    // a of c reached in step.atomCnt such steps is at least as probable as c: if c is above lCutOff, so is a, and base has
+    // it. c is then taken as a + d for that a only, which merges the duplicates of the convolution without any lookups.
+    // Those steps remove the step.atomCnt greatest of the values m / p_ii, for 0 < m <= c_ii, so a is the ancestor of a + d
+    // iff all the isotopes in d have (a_ii + 1) / p_ii above (or tied, with a lower index) the greatest a_jj / p_jj.
+    for(unsigned int aa = 0; aa < base.no_confs; aa++)
+    {
+        if(base.lProbs[aa] < lCutOff)
+            continue;
+        const int* a = base.confs + static_cast<size_t>(aa) * isotopeNo;
+
+        unsigned int top = isotopeNo;
+        for(unsigned int jj = 0; jj < isotopeNo; jj++)
+            if(a[jj] > 0 && (top == isotopeNo || a[jj] * inv_probs[jj] > a[top] * inv_probs[top]))
+                top = jj;
+
+        size_t allowed = 0;
+        for(unsigned int ii = 0; ii < isotopeNo; ii++)
+        {
+            const double value = (a[ii] + 1) * inv_probs[ii];
+            if(top == isotopeNo || value > a[top] * inv_probs[top] || (value == a[top] * inv_probs[top] && ii < top))
+                allowed |= static_cast<size_t>(1) << ii;
+        }
+
+        for(size_t support = allowed; ; support = (support - 1) & allowed)
+        {
+            for(unsigned int dd : by_support[support])
+            {
+                const int* d = step.confs + static_cast<size_t>(dd) * isotopeNo;
+                for(unsigned int ii = 0; ii < isotopeNo; ii++)
+                    child[ii] = a[ii] + d[ii];
+                const double lprob = explored_lprob(child.get(), mode_conf, mode_lprob, loggamma_nominator, atom_lProbs, isotopeNo);
+                if(lprob >= lCutOff)
+                {
+                    append_conf(conf_table, child.get(), isotopeNo);
+                    lprob_table.push_back(lprob);
+                }
+            }
+            if(support == 0)
+                break;
+        }
+    }
+
+    // As the binomial exploration, which always comes out sorted
+    store(conf_table, lprob_table, sort || isotopeNo == 2, lprobs_only);
 }
 
 
 PrecalculatedMarginal::~PrecalculatedMarginal()
 {
-    if(masses != nullptr)
-        delete[] masses;
-    if(probs != nullptr)
-        delete[] probs;
+    free(storage);
 }
 
 
@@ -553,46 +872,124 @@ PrecalculatedMarginal::~PrecalculatedMarginal()
 
 
 
-LayeredMarginal::LayeredMarginal(Marginal&& m, int tabSize, int)
-: Marginal(std::move(m)), current_threshold(1.0), allocator(isotopeNo, tabSize),
-equalizer(isotopeNo), keyHasher(isotopeNo)
+LayeredMarginal::LayeredMarginal(Marginal&& m, int, int)
+: Marginal(std::move(m)), current_threshold(1.0), binomial_down(-1), binomial_up(-1), binomial_down_first(true)
 {
-    fringe.push_back(mode_conf);
+    if(isotopeNo == 2)
+    {
+        binomial_down = mode_conf[1];
+        binomial_up = mode_conf[1] + 1;
+    }
+    else
+    {
+        append_conf(fringe, mode_conf, isotopeNo);
+        fringe_unn_lprobs.push_back(unnormalized_logProb(mode_conf));
+    }
     lProbs.push_back(std::numeric_limits<double>::infinity());
-    fringe_unn_lprobs.push_back(unnormalized_logProb(mode_conf));
     lProbs.push_back(-std::numeric_limits<double>::infinity());
     guarded_lProbs = lProbs.data()+1;
 }
 
 bool LayeredMarginal::extend(double new_threshold, bool do_sort)
 {
-    new_threshold -= loggamma_nominator;
-    if(fringe.empty())
-        return false;
+    if(isotopeNo == 2)
+    {
+        if(binomial_down < 0 && binomial_up > static_cast<int>(atomCnt))
+            return false;
+
+        lProbs.pop_back();  // Remove the +inf guardian
+        // Until the mode is taken, the generic fringe only holds the mode. Taking it puts its upwards neighbour on the fringe
+        // first, so the downward run is explored first, and the next layer starts upwards if that neighbour was taken too.
+        // From then on, the side explored first leaves its new fringe entry first, so the sides alternate.
+        const bool mode_taken = binomial_down != mode_conf[1];
+        const size_t old_size = lProbs.size();
+        const BinomialOrder order = do_sort ? BinomialOrder::descending : binomial_down_first ? BinomialOrder::down_first : BinomialOrder::up_first;
+        binomial_extend(binomial_down, binomial_up, new_threshold, true, order, configurations, lProbs);
+        if(mode_taken)
+            binomial_down_first = !binomial_down_first;
+        else if(lProbs.size() > old_size)
+            binomial_down_first = binomial_up == mode_conf[1] + 1;
+        current_threshold = new_threshold - loggamma_nominator;
+    }
+    else
+    {
+        if(fringe_unn_lprobs.empty())
+            return false;
+
+        lProbs.pop_back();  // Remove the +inf guardian
+
+        pod_vector<int> layer_confs(16 * isotopeNo);
+        pod_vector<double> layer_lprobs;
+        extend_fringe(new_threshold - loggamma_nominator, layer_confs, layer_lprobs);
+
+        // Append the new layer, gathering its rows straight into place if it needs sorting
+        const size_t layer_size = layer_lprobs.size();
+        const size_t confs_size = configurations.size();
+        const size_t lProbs_size = lProbs.size();
+        configurations.resize(confs_size + layer_size * isotopeNo);
+        lProbs.resize(lProbs_size + layer_size);
+
+        if(do_sort)
+            sort_conf_rows(layer_lprobs.data(), layer_confs.data(), configurations.data() + confs_size, layer_size, isotopeNo);
+        else if(layer_size > 0)
+            memcpy(configurations.data() + confs_size, layer_confs.data(), layer_size * isotopeNo * sizeof(int));
+
+        if(layer_size > 0)
+            memcpy(lProbs.data() + lProbs_size, layer_lprobs.data(), layer_size * sizeof(double));
+    }
+
+    const size_t old_no_confs = probs.size();
+    const size_t new_no_confs = lProbs.size() - 1;
+
+    if(probs.capacity() * 2 < new_no_confs + 2)
+    {
+        // Reserve space for new values
+        probs.reserve(new_no_confs);
+        masses.reserve(new_no_confs);
+    }  // Otherwise we're growing slowly enough that standard reallocations on push_back work better - we waste some extra memory
+       // but don't reallocate on every call
+
+    for(size_t ii = old_no_confs; ii < new_no_confs; ii++)
+    {
+        probs.push_back(exp(lProbs[ii+1]));
+        masses.push_back(calc_mass(configurations.data() + ii * isotopeNo, atom_masses, isotopeNo));
+    }
+
+    lProbs.push_back(-std::numeric_limits<double>::infinity());  // Restore guardian
 
-    lProbs.pop_back();  // Remove the +inf guardian
+    guarded_lProbs = lProbs.data()+1;  // Vector might have reallocated its backing storage
 
-    pod_vector<Conf> new_fringe;
+    return true;
+}
+
+void LayeredMarginal::extend_fringe(double new_threshold, pod_vector<int>& layer_confs, pod_vector<double>& layer_lprobs)
+{
+    pod_vector<int> new_fringe(16 * isotopeNo);
     pod_vector<double> new_fringe_unn_lprobs;
 
-    while(!fringe.empty())
+    std::unique_ptr<int[]> currentConf(new int[isotopeNo]);
+    std::unique_ptr<int[]> nc(new int[isotopeNo]);
+
+    while(!fringe_unn_lprobs.empty())
     {
-        Conf currentConf = fringe.back();
-        fringe.pop_back();
+        const int* fringe_back = fringe.data() + fringe.size() - isotopeNo;
+        memcpy(currentConf.get(), fringe_back, isotopeNo * sizeof(int));
+        for(unsigned int ii = 0; ii < isotopeNo; ii++)
+            fringe.pop_back();
 
         double opc = fringe_unn_lprobs.back();
 
         fringe_unn_lprobs.pop_back();
         if(opc < new_threshold)
         {
-            new_fringe.push_back(currentConf);
+            append_conf(new_fringe, currentConf.get(), isotopeNo);
             new_fringe_unn_lprobs.push_back(opc);
         }
 
         else
         {
-            configurations.push_back(currentConf);
-            lProbs.push_back(opc+loggamma_nominator);
+            append_conf(layer_confs, currentConf.get(), isotopeNo);
+            layer_lprobs.push_back(opc+loggamma_nominator);
             for(unsigned int ii = 0; ii < isotopeNo; ii++ )
             {
                 if(currentConf[ii] > mode_conf[ii])
@@ -608,18 +1005,18 @@ bool LayeredMarginal::extend(double new_threshold, bool do_sort)
 
                         if( ii != jj )
                         {
-                            Conf nc = allocator.makeCopy(currentConf);
+                            memcpy(nc.get(), currentConf.get(), isotopeNo * sizeof(int));
                             nc[jj]++;
 
-                            double lpc = unnormalized_logProb(nc);
+                            double lpc = unnormalized_logProb(nc.get());
                             if(lpc >= new_threshold)
                             {
-                                fringe.push_back(nc);
+                                append_conf(fringe, nc.get(), isotopeNo);
                                 fringe_unn_lprobs.push_back(lpc);
                             }
                             else
                             {
-                                new_fringe.push_back(nc);
+                                append_conf(new_fringe, nc.get(), isotopeNo);
                                 new_fringe_unn_lprobs.push_back(lpc);
                             }
                         }
@@ -639,40 +1036,6 @@ bool LayeredMarginal::extend(double new_threshold, bool do_sort)
     current_threshold = new_threshold;
     fringe.swap(new_fringe);
     fringe_unn_lprobs.swap(new_fringe_unn_lprobs);
-
-    if(do_sort)
-    {
-        size_t to_sort_size = configurations.size() - probs.size();
-        if(to_sort_size > 0)
-        {
-            std::unique_ptr<size_t[]> order_arr(get_inverse_order(lProbs.data()+1+probs.size(), to_sort_size));
-            double* P = lProbs.data()+1+probs.size();
-            Conf* C = configurations.data()+probs.size();
-            size_t* O = order_arr.get();
-            impose_order(O, to_sort_size, P, C);
-        }
-    }
-
-    if(probs.capacity() * 2 < configurations.size() + 2)
-    {
-        // Reserve space for new values
-        probs.reserve(configurations.size());
-        masses.reserve(configurations.size());
-    }  // Otherwise we're growing slowly enough that standard reallocations on push_back work better - we waste some extra memory
-       // but don't reallocate on every call
-
-//    printVector(lProbs);
-    for(unsigned int ii = probs.size(); ii < configurations.size(); ii++)
-    {
-        probs.push_back(exp(lProbs[ii+1]));
-        masses.push_back(calc_mass(configurations[ii], atom_masses, isotopeNo));
-    }
-
-    lProbs.push_back(-std::numeric_limits<double>::infinity());  // Restore guardian
-
-    guarded_lProbs = lProbs.data()+1;  // Vector might have reallocated its backing storage
-
-    return true;
 }
 
 
@@ -695,4 +1058,139 @@ double LayeredMarginal::get_max_mass() const
     return ret;
 }
 
+MarginalCache& MarginalCache::global()
+{
+    static MarginalCache cache;
+    return cache;
+}
+
+size_t MarginalCache::KeyHash::operator()(const std::vector<double>& key) const
+{
+    size_t ret = key.size();
+    std::hash<double> hasher;
+    for(double v : key)
+        ret ^= hasher(v) + 0x9e3779b97f4a7c15ULL + (ret << 6) + (ret >> 2);
+    return ret;
+}
+
+// An estimate of the memory taken by a precalculated marginal: its configurations, their probabilities and masses
+static size_t marginal_footprint(const PrecalculatedMarginal& m)
+{
+    return sizeof(PrecalculatedMarginal) + m.get_no_confs() * (m.get_isotopeNo() * sizeof(int) + 3 * sizeof(double));
+}
+
+void MarginalCache::evict_to(size_t max_bytes)
+{
+    while(bytes > max_bytes)
+    {
+        bytes -= marginal_footprint(*lru.back().second);
+        index.erase(lru.back().first);
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+void MarginalCache::set_capacity(size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    capacity = max_bytes;
+    evict_to(capacity);
+}
+
+std::shared_ptr<PrecalculatedMarginal> MarginalCache::get(Marginal&& m, double lCutOff, bool sort, int tabSize, int hashSize, bool lprobs_only)
+{
+    const int isotopeNo = m.get_isotopeNo();
+    std::vector<double> key;
+    key.reserve(3 + 2*isotopeNo);
+    key.push_back(isotopeNo);
+    key.push_back(m.get_atomCnt());
+    key.push_back(sort ? 1.0 : 0.0);
+    key.insert(key.end(), m.get_atom_masses(), m.get_atom_masses() + isotopeNo);
+    key.insert(key.end(), m.get_lProbs(), m.get_lProbs() + isotopeNo);
+
+    // Marginals of up to two isotopes come out sorted anyway
+    const bool sorted = sort || isotopeNo <= 2;
+
+    std::shared_ptr<PrecalculatedMarginal> ret;
+
+    std::unique_lock<std::mutex> lock(mtx);
+    built.wait(lock, [this, &key]() { return building.count(key) == 0; });
+
+    auto it = index.find(key);
+    if(it != index.end())
+    {
+        const double cached_lCutOff = it->second->second->get_lCutOff();
+        if(cached_lCutOff == lCutOff || (sorted && cached_lCutOff < lCutOff))
+        {
+            hits++;
+            lru.splice(lru.begin(), lru, it->second);
+            ret = it->second->second;
+            lock.unlock();
+
+            // The views and materializing are done outside of the lock, the latter at most once per marginal
+            if(cached_lCutOff != lCutOff)
+                ret = std::make_shared<PrecalculatedMarginal>(ret, lCutOff);
+            if(!lprobs_only)
+                ret->materialize();
+            return ret;
+        }
+    }
+
+    misses++;
+    building.insert(key);
+    lock.unlock();
+
+    // Build outside of the lock: it's the expensive part. The marginal takes over the tables of m, so it's returned
+    // even if it doesn't fit in the cache.
+    try
+    {
+        ret = std::make_shared<PrecalculatedMarginal>(std::move(m), lCutOff, sort, tabSize, hashSize, lprobs_only);
+    }
+    catch(...)
+    {
+        lock.lock();
+        building.erase(key);
+        built.notify_all();
+        throw;
+    }
+    const size_t footprint = marginal_footprint(*ret);
+
+    lock.lock();
+    building.erase(key);
+
+    // Replace the marginal precalculated with a higher cutoff, if any
+    it = index.find(key);
+    if(it != index.end())
+    {
+        bytes -= marginal_footprint(*it->second->second);
+        lru.erase(it->second);
+        index.erase(it);
+    }
+
+    if(footprint <= capacity)
+    {
+        evict_to(capacity - footprint);
+        lru.emplace_front(std::move(key), ret);
+        index.emplace(lru.front().first, lru.begin());
+        bytes += footprint;
+    }
+
+    built.notify_all();
+    return ret;
+}
+
+MarginalCache::Stats MarginalCache::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return Stats{hits, misses, evictions, lru.size(), bytes};
+}
+
+void MarginalCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    index.clear();
+    lru.clear();
+    hits = misses = evictions = bytes = 0;
+}
+
 }  // namespace IsoSpec
@@ -21,6 +21,12 @@
 #include <vector>
 #include <functional>
 #include <utility>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
 #include "conf.h"
 #include "allocator.h"
 #include "operators.h"
@@ -89,6 +95,10 @@ class Marginal
 
     inline const double* get_lProbs() const { return atom_lProbs; }
 
+    inline const double* get_atom_masses() const { return atom_masses; }
+
+    inline int get_atomCnt() const { return atomCnt; }
+
     //! Get the mass of the lightest subisotopologue.
     /*! This is trivially obtained by considering all atomNo atoms to be the lightest isotope possible.
         \return The mass of the lightiest subisotopologue.
@@ -156,8 +166,28 @@ class Marginal
         \return The log-probability of the input subisotopologue.
     */
  protected:
-    ISOSPEC_FORCE_INLINE double unnormalized_logProb(Conf conf) const { double ret = 0.0; for(size_t ii = 0; ii < isotopeNo; ii++) ret += minuslogFactorial(conf[ii]) + conf[ii] * atom_lProbs[ii]; return ret; }
-    ISOSPEC_FORCE_INLINE double logProb(Conf conf) const { return loggamma_nominator + unnormalized_logProb(conf); }
+    ISOSPEC_FORCE_INLINE double unnormalized_logProb(const int* conf) const { double ret = 0.0; for(size_t ii = 0; ii < isotopeNo; ii++) ret += minuslogFactorial(conf[ii]) + conf[ii] * atom_lProbs[ii]; return ret; }
+    ISOSPEC_FORCE_INLINE double logProb(const int* conf) const { return loggamma_nominator + unnormalized_logProb(conf); }
+
+    //! The orders in which binomial_extend() can append the subisotopologues.
+    enum class BinomialOrder
+    {
+        descending,     /*!< Merging the two runs. */
+        alternating,    /*!< One from each run in turn, starting downwards, as the breadth-first exploration of PrecalculatedMarginal. */
+        down_first,     /*!< The whole downward run, then the upward one, as the depth-first exploration of LayeredMarginal... */
+        up_first        /*!< ...or the other way round, depending on the order of its fringe. */
+    };
+
+    //! For two-isotope elements: append the subisotopologues (atomCnt-k, k) with log-probabilities not below lCutOff.
+    /*!
+        The binomial log-probability is concave in k, so going from the mode outwards in both directions gives two descending
+        runs, appended in the given order. They continue downwards from k_down and upwards from k_up, which are updated to past
+        the appended subisotopologues, so that the next call picks up where this one left off. The log-probabilities, and the
+        orders other than descending, are those of the generic exploration of LayeredMarginal if layered is set, and of
+        PrecalculatedMarginal otherwise, so the results are the same to the last bit.
+    */
+    void binomial_extend(int& k_down, int& k_up, double lCutOff, bool layered, BinomialOrder order,
+                         pod_vector<int>& confs, pod_vector<double>& lprobs) const;
  public:
     //! Calculate the variance of the theoretical distribution describing the subisotopologue
     double variance() const;
@@ -251,13 +281,15 @@ class MarginalTrek : public Marginal
 class PrecalculatedMarginal : public Marginal
 {
  protected:
-    pod_vector<Conf> configurations;
-    Conf* confs;
+    double lCutOff;
     unsigned int no_confs;
+    void* storage;      /*!< The single allocation holding all the tables below: confs first, then the others, each starting on a cache line. */
+    double* lProbs;     /*!< no_confs+1 entries: the last one is a guardian of -inf. */
+    double* probs;      /*!< Filled in by materialize(), like masses. */
     double* masses;
-    pod_vector<double> lProbs;
-    double* probs;
-    Allocator<int> allocator;
+    int* confs;         /*!< no_confs rows of isotopeNo isotope counts each. */
+    mutable std::once_flag materialized;
+    std::shared_ptr<const PrecalculatedMarginal> prefix_of;  /*!< The marginal whose tables this one shares, if it's a prefix view. */
  public:
     //! The move constructor (disowns the Marginal).
     /*!
@@ -265,6 +297,8 @@ class PrecalculatedMarginal : public Marginal
         \param Marginal An instance of the Marginal class this class is about to disown.
         \param lCutOff The lower limit on the log-probability of the precomputed subisotopologues.
         \param sort Should the subisotopologues be stored with descending probability ?
+        \param tabSize Unused, the subisotopologues are stored in a single contiguous block.
+        \param lprobs_only Leave the probabilities and masses of the subisotopologues out until materialize() is called.
         \return An instance of the PrecalculatedMarginal class.
     */
     PrecalculatedMarginal(
@@ -272,15 +306,57 @@ class PrecalculatedMarginal : public Marginal
         double lCutOff,
         bool sort = true,
         int tabSize = 1000,
-        int hashSize = 1000
+        int hashSize = 1000,
+        bool lprobs_only = false
     );
 
+    //! The marginal of base.atomCnt + step.atomCnt atoms, as the pruned convolution of two marginals of its element (disowns the Marginal).
+    /*!
+        The result is the same as PrecalculatedMarginal(std::move(m), lCutOff, sort) would produce, to the last bit (apart
+        from the order of the subisotopologues, when not sorted), but it's obtained by adding the configurations of step to
+        those of base above lCutOff, instead of exploring the whole marginal anew. As the whole table is written either
+        way, this is not faster than the exploration (about 1.3-2 times slower in benchmarks), so MarginalCache does not
+        derive its marginals this way.
+        \param m The marginal to precalculate: it must describe the same element as base and step, with as many atoms as both.
+        \param base A marginal precalculated with a cutoff not greater than lCutOff.
+        \param step A marginal precalculated with no cutoff (-inf), so that it holds all its subisotopologues.
+        \param lCutOff The lower limit on the log-probability of the precomputed subisotopologues.
+        \param sort Should the subisotopologues be stored with descending probability ?
+        \param lprobs_only Leave the probabilities and masses of the subisotopologues out until materialize() is called.
+    */
+    PrecalculatedMarginal(
+        Marginal&& m,
+        const PrecalculatedMarginal& base,
+        const PrecalculatedMarginal& step,
+        double lCutOff,
+        bool sort = true,
+        bool lprobs_only = false
+    );
+
+    //! A view of the subisotopologues of base with log-probabilities not below lCutOff, sharing its tables.
+    /*!
+        base must be sorted by descending probability, and precalculated with a cutoff not greater than lCutOff: the
+        result is then the same as base would be if precalculated with lCutOff. Only the log-probabilities are copied (to
+        end them with a guardian), the configurations, probabilities and masses are those of base, which the view keeps alive.
+    */
+    PrecalculatedMarginal(const std::shared_ptr<const PrecalculatedMarginal>& base, double lCutOff);
+
     PrecalculatedMarginal(const PrecalculatedMarginal& other) = delete;
     PrecalculatedMarginal& operator=(const PrecalculatedMarginal& other) = delete;
 
     //! Destructor.
     virtual ~PrecalculatedMarginal();
 
+    //! Get the log-probability cutoff the marginal was precalculated with.
+    inline double get_lCutOff() const { return lCutOff; }
+
+    //! Calculate the probabilities and masses of the subisotopologues, if the marginal was constructed with lprobs_only.
+    /*!
+        Until this is done, get_prob(), get_mass() and the tables returned by get_probs_ptr() and get_masses_ptr() hold
+        garbage. Only the first call does any work, and it's safe to call from several threads at once.
+    */
+    void materialize() const;
+
     //! Is there a subisotopologue with a given number?
     /*!
         \return Returns true if idx does not exceed the number of pre-computed configurations.
@@ -312,7 +388,7 @@ class PrecalculatedMarginal : public Marginal
     /*!
         \return Pointer to the first element in the table storing log-probabilities of subisotopologues.
     */
-    inline const double* get_lProbs_ptr() const { return lProbs.data(); }
+    inline const double* get_lProbs_ptr() const { return lProbs; }
 
     //! Get the table of the masses of subisotopologues.
     /*!
@@ -320,13 +396,22 @@ class PrecalculatedMarginal : public Marginal
     */
     inline const double* get_masses_ptr() const { return masses; }
 
+    //! Get the table of the probabilities of subisotopologues.
+    /*!
+        \return Pointer to the first element in the table storing probabilities of subisotopologues.
+    */
+    inline const double* get_probs_ptr() const { return probs; }
+
 
     //! Get the counts of isotopes that define the subisotopologue.
     /*!
         \param idx The number of the considered subisotopologue.
         \return The counts of isotopes that define the subisotopologue.
     */
-    inline const Conf& get_conf(int idx) const { return confs[idx]; }
+    inline const int* get_conf(int idx) const { return confs + static_cast<size_t>(idx) * isotopeNo; }
+
+    //! Get the table of isotope counts of all the subisotopologues: get_no_confs() consecutive rows of get_isotopeNo() entries.
+    inline const int* get_confs_ptr() const { return confs; }
 
     //! Get the number of precomputed subisotopologues.
     /*!
@@ -339,6 +424,12 @@ class PrecalculatedMarginal : public Marginal
         \return The log-probability of a/the most probable subisotopologue.
     */
     inline double getModeLProb() const { return mode_lprob; }
+
+ private:
+    //! Take over the tables of subisotopologues (sorting them if asked to) and set up the storage.
+    void store(pod_vector<int>& conf_table, pod_vector<double>& lprob_table, bool sort, bool lprobs_only);
+
+    void fill_probs_and_masses() const;
 };
 
 
@@ -351,22 +442,24 @@ class LayeredMarginal : public Marginal
 {
  private:
     double current_threshold;
-    pod_vector<Conf> configurations;
-    pod_vector<Conf> fringe;
+    int binomial_down, binomial_up;     /*!< For two-isotope elements: the next k to consider in each direction, see Marginal::binomial_extend */
+    bool binomial_down_first;           /*!< For two-isotope elements: whether the generic fringe would go downwards first in the next layer. */
+    pod_vector<int> configurations;     /*!< Rows of isotopeNo isotope counts, one per subisotopologue. */
+    pod_vector<int> fringe;             /*!< Same layout as configurations. */
     pod_vector<double> fringe_unn_lprobs;
-    Allocator<int> allocator;
-    const ConfEqual equalizer;
-    const KeyHasher keyHasher;
     pod_vector<double> lProbs;
     pod_vector<double> probs;
     pod_vector<double> masses;
     double* guarded_lProbs;
 
+    //! Move the fringe subisotopologues above the new (unnormalized) threshold to the new layer, exploring their neighbours.
+    void extend_fringe(double new_threshold, pod_vector<int>& layer_confs, pod_vector<double>& layer_lprobs);
+
  public:
     //! Move constructor: specializes the Marginal class.
     /*!
-        \param tabSize The size of the table used to store configurations in the allocator.
-        \param hashSize The size of the hash table used to store visited subisotopologues.
+        \param tabSize Unused, the subisotopologues are stored in contiguous tables.
+        \param hashSize Unused.
     */
     LayeredMarginal(Marginal&& m, int tabSize = 1000, int hashSize = 1000);  // NOLINT(runtime/explicit) - constructor deliberately left usable as a conversion
 
@@ -392,11 +485,17 @@ class LayeredMarginal : public Marginal
     //! get the pointer to lProbs array. Accessing index -1 is legal and returns a guardian of -inf. Warning: The pointer gets invalidated on calls to extend()
     inline const double* get_lProbs_ptr() const { return lProbs.data()+1; }
 
+    //! get the pointer to the masses array. Warning: The pointer gets invalidated on calls to extend()
+    inline const double* get_masses_ptr() const { return masses.data(); }
+
+    //! get the pointer to the probabilities array. Warning: The pointer gets invalidated on calls to extend()
+    inline const double* get_probs_ptr() const { return probs.data(); }
+
     //! get the counts of isotopes that define the subisotopologue, see details in @ref PrecalculatedMarginal::get_conf.
-    inline const Conf& get_conf(int idx) const { return configurations[idx]; }
+    inline const int* get_conf(int idx) const { return configurations.data() + static_cast<size_t>(idx) * isotopeNo; }
 
     //! Get the number of precomputed subisotopologues, see details in @ref PrecalculatedMarginal::get_no_confs.
-    inline unsigned int get_no_confs() const { return configurations.size(); }
+    inline unsigned int get_no_confs() const { return masses.size(); }
 
     //! Get the minimal mass in current layer
     double get_min_mass() const;
@@ -412,5 +511,72 @@ class LayeredMarginal : public Marginal
 };
 
 
+//! A process-wide, thread-safe cache of precalculated marginals, evicting the least recently used ones above a memory cap.
+/*!
+    In proteomic workloads the same subisotopologues (say, C250 or H400) turn up in a great many of the molecules, at
+    cutoffs that depend on the rest of the formula. With the cache enabled, IsoThresholdGenerator takes its marginals from it:
+    they are shared between all the generators that need them, instead of being recalculated each time. A marginal
+    precalculated with a lower cutoff serves the higher ones too, through a prefix view (when it's sorted by probability).
+    The cached marginals are never modified, except for being materialized when one built with lprobs_only is needed in full.
+    Only PrecalculatedMarginals are cached, as LayeredMarginals are extended by their generators as they go.
+    The cache is disabled (has zero capacity) by default.
+*/
+class MarginalCache
+{
+ public:
+    struct Stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t entries;
+        size_t bytes;   /*!< An estimate of the memory taken by the cached marginals. */
+    };
+
+    //! The cache used by the generators.
+    static MarginalCache& global();
+
+    explicit MarginalCache(size_t max_bytes = 0) : capacity(max_bytes), hits(0), misses(0), evictions(0), bytes(0) {}
+
+    MarginalCache(const MarginalCache& other) = delete;
+    MarginalCache& operator=(const MarginalCache& other) = delete;
+
+    //! Set the memory cap (in bytes, estimated) on the cached marginals, evicting some if necessary. Zero disables the cache.
+    void set_capacity(size_t max_bytes);
+
+    inline bool enabled() const { std::lock_guard<std::mutex> lock(mtx); return capacity > 0; }
+
+    /*! Get the marginal that PrecalculatedMarginal(std::move(m), lCutOff, sort, tabSize, hashSize) would construct,
+        constructing it (and consuming m) only if there's no cached one it can be obtained from. The marginals are
+        identified by the isotope masses and probabilities, the atom count and the sort flag; a cached one precalculated
+        with a lower cutoff is restricted to lCutOff with a prefix view. Only one thread at a time constructs the marginal
+        for a given key, the others wait for it. If m is consumed, the returned marginal is the one that took over its
+        tables, so it must be kept alive as long as m is used. Unless lprobs_only is set, the returned marginal is materialized. */
+    std::shared_ptr<PrecalculatedMarginal> get(Marginal&& m, double lCutOff, bool sort, int tabSize, int hashSize, bool lprobs_only = false);
+
+    Stats get_stats() const;
+
+    //! Drop all the cached marginals (the generators still using some keep them alive) and zero the statistics.
+    void clear();
+
+ private:
+    struct KeyHash
+    {
+        size_t operator()(const std::vector<double>& key) const;
+    };
+
+    typedef std::pair<std::vector<double>, std::shared_ptr<PrecalculatedMarginal> > Entry;
+
+    void evict_to(size_t max_bytes);
+
+    mutable std::mutex mtx;
+    std::condition_variable built;   /*!< Signalled whenever a marginal is done being constructed. */
+    std::list<Entry> lru;   /*!< The cached marginals, the most recently used first. */
+    std::unordered_map<std::vector<double>, std::list<Entry>::iterator, KeyHash> index;
+    std::unordered_set<std::vector<double>, KeyHash> building;  /*!< The keys of the marginals being constructed right now. */
+    size_t capacity;
+    size_t hits, misses, evictions, bytes;
+};
+
 
 }  // namespace IsoSpec
@@ -16,9 +16,13 @@
 
 
 #include "misc.h"
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <utility>
 #include "platform.h"
 #include "isoMath.h"
+#include "parallel.h"
 
 
 
@@ -65,4 +69,180 @@ void* quickselect(void ** array, int n, int start, int end)
     };
 }
 
+// Unsigned integers, in ascending order as the doubles are in descending one
+static inline uint64_t descending_key(double x)
+{
+    uint64_t u;
+    memcpy(&u, &x, sizeof(u));
+    return (u >> 63) ? u : ~(u | (1ULL << 63));
+}
+
+static inline double from_descending_key(uint64_t k)
+{
+    const uint64_t u = (k >> 63) ? k : ~k & ~(1ULL << 63);
+    double x;
+    memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+void radix_sort_descending(double* keys, unsigned int* order, size_t N)
+{
+    if(N < 256)
+    {
+        for(size_t ii = 0; ii < N; ii++)
+            order[ii] = static_cast<unsigned int>(ii);
+        sort_descending_together(keys, order, N);
+        return;
+    }
+
+    struct Record
+    {
+        uint64_t key;
+        unsigned int idx;
+    };
+
+    std::unique_ptr<Record[]> buffer(new Record[2*N]);
+    Record* src = buffer.get();
+    Record* dst = buffer.get() + N;
+
+    std::unique_ptr<size_t[]> counts(new size_t[8*256]());
+
+    for(size_t ii = 0; ii < N; ii++)
+    {
+        const uint64_t key = descending_key(keys[ii]);
+        src[ii].key = key;
+        src[ii].idx = static_cast<unsigned int>(ii);
+        for(unsigned int byte = 0; byte < 8; byte++)
+            counts[byte*256 + ((key >> (8*byte)) & 0xFF)]++;
+    }
+
+    for(unsigned int byte = 0; byte < 8; byte++)
+    {
+        size_t* cnt = counts.get() + byte*256;
+        const unsigned int shift = 8*byte;
+        if(cnt[(src[0].key >> shift) & 0xFF] == N)
+            continue;  // All the keys agree on this byte
+
+        size_t offset = 0;
+        for(unsigned int ii = 0; ii < 256; ii++)
+        {
+            const size_t c = cnt[ii];
+            cnt[ii] = offset;
+            offset += c;
+        }
+
+        for(size_t ii = 0; ii < N; ii++)
+            dst[cnt[(src[ii].key >> shift) & 0xFF]++] = src[ii];
+
+        std::swap(src, dst);
+    }
+
+    for(size_t ii = 0; ii < N; ii++)
+    {
+        keys[ii] = from_descending_key(src[ii].key);
+        order[ii] = src[ii].idx;
+    }
+}
+
+// Unsigned integers, in the same order as the doubles
+static inline uint64_t ascending_key(double x)
+{
+    uint64_t u;
+    memcpy(&u, &x, sizeof(u));
+    return (u >> 63) ? ~u : (u | (1ULL << 63));
+}
+
+void radix_order_ascending(const double* keys, size_t* order, size_t N, unsigned int n_threads)
+{
+    if(N < 256)
+    {
+        for(size_t ii = 0; ii < N; ii++)
+            order[ii] = ii;
+        std::stable_sort(order, order + N, [keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+        return;
+    }
+
+    struct Record
+    {
+        uint64_t key;
+        size_t idx;
+    };
+
+    std::unique_ptr<Record[]> buffer(new Record[2*N]);
+    Record* src = buffer.get();
+    Record* dst = buffer.get() + N;
+
+    // Chunks of fewer than 64k entries aren't worth a thread
+    n_threads = resolve_threads_no(n_threads);
+    const size_t no_chunks = (std::max<size_t>)(1, (std::min<size_t>)(n_threads, N >> 16));
+    auto chunk_begin = [N, no_chunks](size_t chunk) { return N / no_chunks * chunk + (std::min)(chunk, N % no_chunks); };
+
+    // counts[chunk*256 + digit], for the byte of the current pass, and totals[byte*256 + digit] for the whole table
+    std::unique_ptr<size_t[]> counts(new size_t[no_chunks*256]);
+    std::unique_ptr<size_t[]> totals(new size_t[8*256]());
+    std::unique_ptr<size_t[]> chunk_totals(new size_t[no_chunks*8*256]());
+
+    parallel_for(no_chunks, n_threads, [&](size_t chunk, unsigned int)
+    {
+        size_t* cnt = chunk_totals.get() + chunk*8*256;
+        for(size_t ii = chunk_begin(chunk); ii < chunk_begin(chunk+1); ii++)
+        {
+            const uint64_t key = ascending_key(keys[ii]);
+            src[ii].key = key;
+            src[ii].idx = ii;
+            for(unsigned int byte = 0; byte < 8; byte++)
+                cnt[byte*256 + ((key >> (8*byte)) & 0xFF)]++;
+        }
+    });
+
+    for(size_t chunk = 0; chunk < no_chunks; chunk++)
+        for(unsigned int ii = 0; ii < 8*256; ii++)
+            totals[ii] += chunk_totals[chunk*8*256 + ii];
+
+    bool permuted = false;
+
+    for(unsigned int byte = 0; byte < 8; byte++)
+    {
+        const unsigned int shift = 8*byte;
+        if(totals[byte*256 + ((src[0].key >> shift) & 0xFF)] == N)
+            continue;  // All the keys agree on this byte
+
+        // Until the first scatter the chunks hold the records they were counted from
+        if(permuted)
+            parallel_for(no_chunks, n_threads, [&](size_t chunk, unsigned int)
+            {
+                size_t* cnt = counts.get() + chunk*256;
+                memset(cnt, 0, 256*sizeof(size_t));
+                for(size_t ii = chunk_begin(chunk); ii < chunk_begin(chunk+1); ii++)
+                    cnt[(src[ii].key >> shift) & 0xFF]++;
+            });
+        else
+            for(size_t chunk = 0; chunk < no_chunks; chunk++)
+                memcpy(counts.get() + chunk*256, chunk_totals.get() + chunk*8*256 + byte*256, 256*sizeof(size_t));
+
+        // Digit-major, chunk-minor offsets keep the sort stable
+        size_t offset = 0;
+        for(unsigned int digit = 0; digit < 256; digit++)
+            for(size_t chunk = 0; chunk < no_chunks; chunk++)
+            {
+                const size_t c = counts[chunk*256 + digit];
+                counts[chunk*256 + digit] = offset;
+                offset += c;
+            }
+
+        parallel_for(no_chunks, n_threads, [&](size_t chunk, unsigned int)
+        {
+            size_t* cnt = counts.get() + chunk*256;
+            for(size_t ii = chunk_begin(chunk); ii < chunk_begin(chunk+1); ii++)
+                dst[cnt[(src[ii].key >> shift) & 0xFF]++] = src[ii];
+        });
+
+        std::swap(src, dst);
+        permuted = true;
+    }
+
+    for(size_t ii = 0; ii < N; ii++)
+        order[ii] = src[ii].idx;
+}
+
 }  // namespace IsoSpec
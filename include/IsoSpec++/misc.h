@@ -20,6 +20,8 @@
 #include <vector>
 #include <cstring>
 #include <algorithm>
+#include <memory>
+#include <utility>
 #include "isoMath.h"
 #include "pod_vector.h"
 
@@ -116,6 +118,24 @@ template<typename T> void printNestedArray(const T** array, const int* shape, in
 void* quickselect(const void** array, int n, int start, int end);
 
 
+//! Find the last element not below the cutoff in a descending range [begin, end), returning begin-1 if there's none.
+/*!
+    Uses a galloping search from begin, so the cost is logarithmic in the distance to the result rather than
+    in the length of the range: short runs at the beginning of a long table are found in a couple of steps.
+*/
+inline const double* last_not_below(const double* begin, const double* end, double cutoff)
+{
+    const size_t len = end - begin;
+    size_t lo = 0;
+    size_t bound = 1;
+    while(bound <= len && begin[bound-1] >= cutoff)
+    {
+        lo = bound;
+        bound *= 2;
+    }
+    return std::partition_point(begin + lo, begin + (std::min)(bound, len), [cutoff](double x) { return x >= cutoff; }) - 1;
+}
+
 template <typename T> inline static T* array_copy(const T* A, int size)
 {
     T* ret = new T[size];
@@ -195,5 +215,42 @@ template<typename TA, typename TB> void impose_order(size_t* O, size_t N, TA* A,
     }
 }
 
+//! Sort A in descending order, moving the entries of B along with it.
+/*!
+    Equivalent to get_inverse_order followed by impose_order, but the (key, value) pairs are sorted packed
+    together, so the comparisons stream through memory instead of chasing an index array through A.
+    For tables of millions of entries this is several times faster. Needs N*sizeof(std::pair<TA, TB>) bytes of scratch space.
+*/
+template<typename TA, typename TB> void sort_descending_together(TA* A, TB* B, size_t N)
+{
+    std::unique_ptr<std::pair<TA, TB>[]> tmp(new std::pair<TA, TB>[N]);
+    for(size_t ii = 0; ii < N; ii++)
+        tmp[ii] = std::make_pair(A[ii], B[ii]);
+
+    std::sort(tmp.get(), tmp.get() + N, [](const std::pair<TA, TB>& a, const std::pair<TA, TB>& b) { return a.first > b.first; });
+
+    for(size_t ii = 0; ii < N; ii++)
+    {
+        A[ii] = tmp[ii].first;
+        B[ii] = tmp[ii].second;
+    }
+}
+
+//! Sort keys in descending order with an LSD radix sort on their bits, recording in order the original position of each.
+/*!
+    The keys and their positions move together, in 16-byte records, and the byte positions on which all the keys agree
+    (typically the sign and exponent ones, for the log-probabilities of a layer) are skipped. Short tables are handed to
+    sort_descending_together. No NaNs please.
+*/
+void radix_sort_descending(double* keys, unsigned int* order, size_t N);
+
+//! Find the permutation sorting keys in ascending order, stably, with an LSD radix sort on their bits, on up to n_threads threads.
+/*!
+    On return order[ii] is the original position of the ii-th smallest key; keys are not modified. Each pass of the sort
+    splits the table into one chunk per thread: the chunks are counted in parallel, and then scattered in parallel, each
+    to the output positions it owns. As in radix_sort_descending, byte positions on which all the keys agree are skipped.
+    No NaNs please.
+*/
+void radix_order_ascending(const double* keys, size_t* order, size_t N, unsigned int n_threads = 1);
 
 }  // namespace IsoSpec
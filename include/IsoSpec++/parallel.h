@@ -0,0 +1,88 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <algorithm>
+#include "platform.h"
+
+namespace IsoSpec
+{
+
+//! Translate the user-supplied number of threads into an actual one: 0 means "as many as there are cores".
+inline unsigned int resolve_threads_no(unsigned int n_threads)
+{
+    if(n_threads == 0)
+        n_threads = std::thread::hardware_concurrency();
+    return n_threads == 0 ? 1 : n_threads;
+}
+
+//! Run f(task_idx, thread_idx) for every task_idx in [0, n_tasks) on a pool of n_threads workers.
+/*!
+    Tasks are handed out dynamically (the next free worker takes the next task), so it's fine for their
+    sizes to vary wildly, as they usually do when splitting a configuration space. The calling thread
+    is used as worker 0. The first exception thrown by any task is rethrown here, after all workers finish.
+*/
+template<typename F> void parallel_for(size_t n_tasks, unsigned int n_threads, F&& f)
+{
+    n_threads = static_cast<unsigned int>((std::min<size_t>)(resolve_threads_no(n_threads), n_tasks));
+
+    if(n_threads <= 1)
+    {
+        for(size_t ii = 0; ii < n_tasks; ii++)
+            f(ii, 0u);
+        return;
+    }
+
+    std::atomic<size_t> next_task(0);
+    std::exception_ptr error = nullptr;
+    std::atomic<bool> failed(false);
+
+    auto worker = [&](unsigned int thread_idx)
+    {
+        try
+        {
+            size_t task;
+            while(!failed.load(std::memory_order_relaxed) && (task = next_task.fetch_add(1, std::memory_order_relaxed)) < n_tasks)
+                f(task, thread_idx);
+        }
+        catch(...)
+        {
+            if(!failed.exchange(true))
+                error = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(n_threads-1);
+    for(unsigned int ii = 1; ii < n_threads; ii++)
+        threads.emplace_back(worker, ii);
+
+    worker(0);
+
+    for(auto& t : threads)
+        t.join();
+
+    if(error)
+        std::rethrow_exception(error);
+}
+
+}  // namespace IsoSpec
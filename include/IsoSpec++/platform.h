@@ -52,6 +52,10 @@
 #define ISOSPEC_GOT_MMAN ISOSPEC_TEST_GOT_MMAN
 #endif
 
+#if !defined(ISOSPEC_CACHE_LINE_SIZE)
+#define ISOSPEC_CACHE_LINE_SIZE 64
+#endif
+
 
 // Note: __GNUC__ is defined by clang and gcc
 #ifdef __GNUC__
@@ -217,6 +217,14 @@ template<typename T> class pod_vector
         first_free = store = backend_past_end = NULL;
     }
 
+    //! Hand over the backing storage (to be free()d by the caller) and leave the vector empty.
+    T* release() noexcept
+    {
+        T* ret = store;
+        first_free = store = backend_past_end = NULL;
+        return ret;
+    }
+
     friend class unsafe_pod_vector<T>;
 };
 
@@ -0,0 +1,87 @@
+/*
+ *   Regression test for the PrecalculatedMarginal derived from a marginal with fewer atoms and a small step one.
+ *
+ *   The derived marginal must hold the same subisotopologues as the one precalculated from scratch, with the same
+ *   log-probabilities to the last bit, and in the order of descending probability when sorted.
+ *
+ *   g++ -std=c++17 -I../../include/IsoSpec++ derived_marginal.cpp ../../unity-build.cpp -lpthread
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "marginalTrek++.h"
+
+using namespace IsoSpec;
+
+struct Element
+{
+    int isotopeNo;
+    double masses[6];
+    double probs[6];
+    int atomCnts[3];
+};
+
+static const Element elements[] = {
+    {2, {12.0, 13.0033548352}, {0.9893, 0.0107}, {20, 150, 2000}},
+    {4, {31.97207117, 32.97145876, 33.9678669, 35.96708071}, {0.9499, 0.0075, 0.0425, 0.0001}, {20, 150, 600}},
+    {6, {73.922475934, 75.919213704, 76.919914154, 77.91730928, 79.9165218, 81.9166995}, {0.0089, 0.0937, 0.0763, 0.2377, 0.4961, 0.0873}, {3, 10, 30}}
+};
+
+static std::vector<std::pair<std::vector<int>, double>> contents(const IsoSpec::PrecalculatedMarginal& marginal)
+{
+    std::vector<std::pair<std::vector<int>, double>> ret;
+    for(unsigned int ii = 0; ii < marginal.get_no_confs(); ii++)
+        ret.emplace_back(std::vector<int>(marginal.get_conf(ii), marginal.get_conf(ii) + marginal.get_isotopeNo()), marginal.get_lProb(ii));
+    return ret;
+}
+
+static Marginal make(const Element& element, int atomCnt)
+{
+    Marginal ret(element.masses, element.probs, element.isotopeNo, atomCnt);
+    ret.ensureModeConf();
+    return ret;
+}
+
+int main()
+{
+    int failures = 0;
+
+    for(const Element& element : elements)
+        for(int atomCnt : element.atomCnts)
+            for(int k : {1, 2, 5})
+                for(double below_mode : {1.0, 5.0, 15.0})
+                    for(bool sort : {false, true})
+                    {
+                        Marginal base_marginal = make(element, atomCnt);
+                        const double lCutOff = make(element, atomCnt + k).getModeLProb() - below_mode;
+                        IsoSpec::PrecalculatedMarginal base(std::move(base_marginal), lCutOff - 1.0, sort);
+                        IsoSpec::PrecalculatedMarginal step(make(element, k), -std::numeric_limits<double>::infinity(), false);
+
+                        IsoSpec::PrecalculatedMarginal fresh(make(element, atomCnt + k), lCutOff, sort);
+                        IsoSpec::PrecalculatedMarginal derived(make(element, atomCnt + k), base, step, lCutOff, sort);
+
+                        std::vector<std::pair<std::vector<int>, double>> fresh_contents = contents(fresh);
+                        std::vector<std::pair<std::vector<int>, double>> derived_contents = contents(derived);
+                        bool same = fresh_contents.size() == derived_contents.size();
+
+                        // Sorted, the log-probabilities must come in the same order; the order of ties may differ
+                        for(size_t ii = 0; ii < fresh_contents.size() && same && sort; ii++)
+                            same = fresh_contents[ii].second == derived_contents[ii].second;
+
+                        std::sort(fresh_contents.begin(), fresh_contents.end());
+                        std::sort(derived_contents.begin(), derived_contents.end());
+                        same = same && fresh_contents == derived_contents;
+
+                        if(!same)
+                        {
+                            printf("Mismatch: %d isotopes, %d+%d atoms, %g below the mode, sort=%d\n", element.isotopeNo, atomCnt, k, below_mode, sort);
+                            failures++;
+                        }
+                    }
+
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+/*
+ *   Regression test for MarginalCache: several threads missing on the same marginals at once.
+ *
+ *   Each thread's Iso hands its marginal tables over to the cache on a miss; the generator must keep the marginal that
+ *   took them over alive, also when another thread constructed the same one concurrently. Best run under AddressSanitizer:
+ *
+ *   g++ -std=c++17 -g -fsanitize=address -I../../include/IsoSpec++ marginal_cache_threads.cpp ../../unity-build.cpp -lpthread
+ */
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "isoSpec++.h"
+#include "marginalTrek++.h"
+
+using namespace IsoSpec;
+
+int main()
+{
+    const unsigned int n_threads = 8;
+    int failures = 0;
+
+    IsoThresholdGenerator reference(Iso("C500H800N100O150S5Se1"), 1e-6, false);
+    const double lightest = reference.getLightestPeakMass();
+    size_t reference_count = 0;
+    while(reference.advanceToNextConfiguration())
+        reference_count++;
+
+    MarginalCache::global().set_capacity(1 << 28);
+
+    for(int round = 0; round < 50; round++)
+    {
+        MarginalCache::global().clear();
+
+        std::vector<double> masses(n_threads);
+        std::vector<size_t> counts(n_threads);
+        std::vector<std::thread> threads;
+        for(unsigned int ii = 0; ii < n_threads; ii++)
+            threads.emplace_back([ii, &masses, &counts]()
+            {
+                IsoThresholdGenerator generator(Iso("C500H800N100O150S5Se1"), 1e-6, false);
+                masses[ii] = generator.getLightestPeakMass();
+                counts[ii] = 0;
+                while(generator.advanceToNextConfiguration())
+                    counts[ii]++;
+            });
+
+        for(std::thread& thread : threads)
+            thread.join();
+
+        for(unsigned int ii = 0; ii < n_threads; ii++)
+            if(masses[ii] != lightest || counts[ii] != reference_count)
+                failures++;
+
+        const MarginalCache::Stats stats = MarginalCache::global().get_stats();
+        // Each of the 6 marginals is constructed once, the other threads wait for it
+        if(stats.misses != 6 || stats.hits != 6 * (n_threads - 1))
+            failures++;
+    }
+
+    MarginalCache::global().set_capacity(0);
+
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
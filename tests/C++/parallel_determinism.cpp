@@ -0,0 +1,60 @@
+/*
+ *   Regression test for the parallel envelopes: their results must not depend on the number of threads.
+ *
+ *   FromThreshold and FromTotalProb (unoptimized) on several threads must give the same peaks, in the same order, as on
+ *   one; FromStochasticSeeded must give the same sample for the same seed. Compared bit for bit, configurations included.
+ *
+ *   g++ -std=c++17 -I../../include/IsoSpec++ parallel_determinism.cpp ../../unity-build.cpp -lpthread
+ */
+
+#include <cstdio>
+#include <cstring>
+#include "isoSpec++.h"
+#include "fixedEnvelopes.h"
+
+using namespace IsoSpec;
+
+static bool identical(const FixedEnvelope& a, const FixedEnvelope& b)
+{
+    if(a.confs_no() != b.confs_no() || a.getAllDim() != b.getAllDim())
+        return false;
+    const size_t n = a.confs_no();
+    return memcmp(a.masses(), b.masses(), n * sizeof(double)) == 0 &&
+           memcmp(a.probs(), b.probs(), n * sizeof(double)) == 0 &&
+           memcmp(a.confs(), b.confs(), n * a.getAllDim() * sizeof(int)) == 0;
+}
+
+int main()
+{
+    const char* formulas[] = {"C100H202", "C520H817N139O147S8", "C1000H2000N300O300S20Se2", "H2O1"};
+    int failures = 0;
+
+    for(const char* formula : formulas)
+    {
+        FixedEnvelope threshold = FixedEnvelope::FromThreshold(Iso(formula), 1e-7, false, true, 1);
+        FixedEnvelope total_prob = FixedEnvelope::FromTotalProb(Iso(formula), 0.9999, false, true, 1);
+        FixedEnvelope stochastic = FixedEnvelope::FromStochasticSeeded(Iso(formula), 1000000, 42, 0.9999, 5.0, true, 1);
+
+        for(unsigned int n_threads : {2u, 3u, 8u})
+        {
+            if(!identical(threshold, FixedEnvelope::FromThreshold(Iso(formula), 1e-7, false, true, n_threads)))
+            {
+                printf("FromThreshold mismatch: %s, %u threads\n", formula, n_threads);
+                failures++;
+            }
+            if(!identical(total_prob, FixedEnvelope::FromTotalProb(Iso(formula), 0.9999, false, true, n_threads)))
+            {
+                printf("FromTotalProb mismatch: %s, %u threads\n", formula, n_threads);
+                failures++;
+            }
+            if(!identical(stochastic, FixedEnvelope::FromStochasticSeeded(Iso(formula), 1000000, 42, 0.9999, 5.0, true, n_threads)))
+            {
+                printf("FromStochasticSeeded mismatch: %s, %u threads\n", formula, n_threads);
+                failures++;
+            }
+        }
+    }
+
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
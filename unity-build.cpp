@@ -35,6 +35,7 @@
 #include "fasta.cpp"            // NOLINT(build/include)
 #include "cwrapper.cpp"         // NOLINT(build/include)
 #include "fixedEnvelopes.cpp"   // NOLINT(build/include)
+#include "envelopeLibrary.cpp"  // NOLINT(build/include)
 #include "misc.cpp"             // NOLINT(build/include)
 
 #endif